@@ -0,0 +1,1710 @@
+//
+// Copyright 2013,2014,2015 Tarim
+//
+// Poll is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Poll is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with Poll.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+//
+// The definitions behind libpoll.h: the engine's sources, event loop,
+// statistics, workers and replay, and the shared defaults
+//
+
+
+
+#include "libpoll.h"
+
+
+
+// Lines output for quadrature steps: "-1" and "+1"
+char stepText[] = "-1+1";
+
+// Used when a file has no +FORMAT or --delimiters of its own
+Format defaultFormat( "+%l\n" );
+Delimiters defaultDelimiters( "\n" );
+
+
+
+//
+// the decoder named by --decode, or NULL if there isn't one
+//
+Decoder *Decoder::create( const char *name ) {
+    if( strcmp( name, "rfid125" ) == 0 ) {
+        return new RfidDecoder;
+
+    } else if( strcmp( name, "hex" ) == 0 ) {
+        return new HexDecoder;
+
+    } else if( strncmp( name, "fixed:", 6 ) == 0 ) {
+        const size_t size = strtoul( name + 6, NULL, 0 );
+        return size ? new FixedDecoder( size ) : NULL;
+    }
+    return NULL;
+};
+
+
+
+//
+// check status and set modes for a pathname, returns false on error
+//
+bool Source::statpfd() {
+    if( stat( pathname, &status ) < 0 ) {
+        reportpfd( pathname );
+        return false;
+    }
+
+    // system file e.g. /sys/class/gpio/gpioN/value
+    if( S_ISREG( status.st_mode ) ) {
+        openMode = O_RDONLY;
+        pollEvents = POLLPRI;
+        reseek = true;
+
+    // character device e.g. /dev/ttyUSB0
+    } else if( S_ISCHR( status.st_mode ) ) {
+        openMode = O_RDONLY | O_NONBLOCK;
+        pollEvents = POLLIN;
+        reseek = false;
+
+    // fifo e.g. /tmp/fifo
+    } else if( S_ISFIFO( status.st_mode ) ) {
+        openMode = O_RDWR | O_NONBLOCK;
+        pollEvents = POLLIN;
+        reseek = false;
+
+    } else {
+        fprintf( stderr, "Invalid device: %s\n", pathname );
+        return false;
+    }
+    return true;
+};
+
+
+
+//
+// request gpiochipN:LINE[,LINE...][:up|:down] lines for edge events
+// through the GPIO character device, returns the line request's file
+// descriptor or -1 on error.  All the lines share the request so their
+// events arrive in the order the kernel saw them.
+//
+int Source::requestgpio() {
+    struct gpio_v2_line_request request;
+    if( !linespfd( request ) ) {
+        return -1;
+    }
+
+    const char *colon = strchr( pathname, ':' );
+    char chip[PATH_MAX];
+    snprintf( chip, sizeof( chip ), "/dev/%.*s", (int)(colon - pathname), pathname );
+
+    const int chipFd = open( chip, O_RDONLY );
+    const int result = chipFd < 0 ? -1 : ioctl( chipFd, GPIO_V2_GET_LINE_IOCTL, &request );
+    if( result < 0 ) {
+        reportpfd( chipFd < 0 ? chip : pathname );
+        if( chipFd >= 0 ) {
+            close( chipFd );
+        }
+        free( lineOffset );
+        lineOffset = NULL;
+        return -1;
+    }
+    close( chipFd );
+
+    fcntl( request.fd, F_SETFL, O_NONBLOCK );
+    return request.fd;
+};
+
+
+
+//
+// parse the gpiochip lines and pull from the pathname into a line
+// request and set lineOffset, returns false on error
+//
+bool Source::linespfd( struct gpio_v2_line_request &request ) {
+    const char *colon = strchr( pathname, ':' );
+
+    memset( &request, 0, sizeof( request ) );
+    snprintf( request.consumer, sizeof( request.consumer ), "poll" );
+    request.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+
+    char *end = (char *)colon;
+    do {
+        const char *start = end + 1;
+        if( request.num_lines >= GPIO_V2_LINES_MAX ) {
+            fprintf( stderr, "Too many gpio lines: %s\n", pathname );
+            return false;
+        }
+        request.offsets[request.num_lines] = strtoul( start, &end, 10 );
+        if( end == start ) {
+            fprintf( stderr, "Invalid gpio line: %s\n", pathname );
+            return false;
+        }
+        ++request.num_lines;
+    } while( *end == ',' );
+
+    if( strcmp( end, ":up" ) == 0 ) {
+        request.config.flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+
+    } else if( strcmp( end, ":down" ) == 0 ) {
+        request.config.flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
+
+    } else if( *end ) {
+        fprintf( stderr, "Invalid gpio line: %s\n", pathname );
+        return false;
+    }
+
+    if( option.quadrature && request.num_lines != 2 ) {
+        fprintf( stderr, "Quadrature needs two gpio lines: %s\n", pathname );
+        return false;
+    }
+
+    lineCount = request.num_lines;
+    lineOffset = (uint32_t *)malloc( sizeof( uint32_t ) * lineCount );
+    if( !lineOffset ) {
+        perror( "malloc" );
+        return false;
+    }
+    memcpy( lineOffset, request.offsets, sizeof( uint32_t ) * lineCount );
+    return true;
+};
+
+
+
+//
+// open the device, returns false on error
+//
+bool Source::devicepfd() {
+    // reads come from the --replay log, gpiochip sources still need
+    // their lines
+    if( loop->replaying ) {
+        struct gpio_v2_line_request request;
+        loop->pfd[index].fd = -1;
+        loop->pfd[index].events = POLLIN;
+        loop->pfd[index].revents = 0;
+        pollEvents = POLLIN;
+        reseek = false;
+        return !gpio || linespfd( request );
+    }
+
+    if( gpio ) {
+        loop->pfd[index].fd = requestgpio();
+        pollEvents = POLLIN;
+        reseek = false;
+
+    } else if( option.quadrature ) {
+        fprintf( stderr, "Quadrature needs two gpio lines: %s\n", pathname );
+        loop->pfd[index].fd = -1;
+
+    } else if( !statpfd() ) {
+        loop->pfd[index].fd = -1;
+
+    } else {
+        loop->pfd[index].fd = open( pathname, openMode );
+        if( loop->pfd[index].fd < 0 ) {
+            reportpfd( pathname );
+        }
+    }
+
+    loop->pfd[index].events = pollEvents;
+    loop->pfd[index].revents = 0;
+    return loop->pfd[index].fd >= 0;
+};
+
+
+
+//
+// watch the directory of a --reopen file so it can be reopened as soon
+// as it reappears
+//
+void Source::watchpfd() {
+    if( !option.reopen || loop->inotifyFd < 0 ) {
+        return;
+    }
+
+    char directory[PATH_MAX];
+    const char *slash = strrchr( pathname, '/' );
+    if( gpio ) {
+        strcpy( directory, "/dev" );
+
+    } else if( slash ) {
+        snprintf( directory, sizeof( directory ), "%.*s", slash == pathname ? 1 : (int)(slash - pathname), pathname );
+
+    } else {
+        strcpy( directory, "." );
+    }
+
+    // the same directory is only watched once however many files are in it
+    if( inotify_add_watch( loop->inotifyFd, directory, IN_CREATE | IN_ATTRIB | IN_MOVED_TO ) < 0 ) {
+        perror( directory );
+    }
+};
+
+
+
+//
+// open the file descriptor and set the modes, returns false (leaving
+// the slot free) on error
+//
+bool Source::openpfd( EventLoop *eventLoop, const nfds_t pfdi, char *fname, const PFDOption *argOption ) {
+    loop = eventLoop;
+    index = pfdi;
+    pathname = fname;
+    pathLength = strlen( pathname );
+    option = *argOption;
+    control = false;
+    watcher = false;
+    reopening = false;
+    failed = false;
+    backoff = reopenBackoffMin;
+    lineOffset = NULL;
+
+    if( option.decoder && option.decoder->longest() > option.lineMax ) {
+        fprintf( stderr, "Record longer than max-line: %s\n", pathname );
+        pathname = NULL;
+        return false;
+    }
+
+    gpio = strncmp( pathname, "gpiochip", 8 ) == 0 && strchr( pathname, ':' );
+    if( !devicepfd() ) {
+        if( !option.reopen ) {
+            pathname = NULL;
+            return false;
+        }
+
+        // wait for it to appear
+        fprintf( stderr, "Waiting for: %s\n", pathname );
+        reopening = true;
+    }
+    watchpfd();
+
+    readTime.clear();
+    printTime = 0;
+    suppressed = 0;
+    edgeTime = 0;
+    settleTime = 0;
+    slotsUsed = 0;
+    edgeSequence = 0;
+    lineBits = 0;
+    quadratureCount = 0;
+    debounce.init();
+    bounce.init();
+    memset( &counter, 0, sizeof( counter ) );
+
+    if( option.format->longest( option.lineMax, pathLength ) > PIPE_BUF ) {
+        fprintf( stderr, "Warning: output for %s may exceed %d bytes and not be written atomically\n", pathname, PIPE_BUF );
+    }
+
+    // the slot's ring in the loop's block unless the file's lines are
+    // longer than it was sized for
+    ringSize = gpio ? gpioSlots * digitsMax : ringLines * option.lineMax;
+    ringOwned = ringBytes( option.lineMax, gpio ) > loop->ringStride;
+    ring = ringOwned ? (char *)malloc( ringBytes( option.lineMax, gpio ) ) : loop->rings + index * loop->ringStride;
+    if( !ring ) {
+        perror( "malloc" );
+        closepfd();
+        return false;
+    }
+    pin[0] = ring + ringSize;
+    pin[1] = pin[0] + option.lineMax;
+    lineStart = 0;
+    readEnd = 0;
+
+    printPtr = ring;
+    printLength = 0;
+    heldPtr = NULL;
+    replayPtr = NULL;
+    replayLength = 0;
+    return true;
+};
+
+
+
+//
+// stop watching and close the file, freeing its slot
+//
+void Source::closepfd() {
+    loop->output.flush();         // batched lines may still point into the ring
+
+    const int fd = loop->pfd[index].fd;
+    loop->backend.remove( index );
+    if( fd >= 0 ) {
+        close( fd );
+    }
+    loop->pfd[index].revents = 0;
+
+    loop->timers.cancel( index );
+    heldPtr = NULL;
+
+    if( ringOwned ) {
+        free( ring );
+    }
+    free( lineOffset );
+    pathname = NULL;
+};
+
+
+
+//
+// open the inotify descriptor as a file so it is waited for with the
+// others
+//
+void Source::openwatcher( EventLoop *eventLoop, const nfds_t pfdi ) {
+    loop = eventLoop;
+    index = pfdi;
+    pathname = (char *)"inotify";
+    pathLength = strlen( pathname );
+    option.init();
+    control = false;
+    watcher = true;
+    reopening = false;
+    failed = false;
+    gpio = false;
+    lineOffset = NULL;
+    ring = NULL;
+    ringOwned = false;
+    heldPtr = NULL;
+    bounce.init();
+    memset( &counter, 0, sizeof( counter ) );
+
+    loop->pfd[index].fd = loop->inotifyFd;
+    loop->pfd[index].events = POLLIN;
+    loop->pfd[index].revents = 0;
+};
+
+
+
+//
+// the file has gone (hangup or read error): output any held line and
+// close it then, with --reopen, try again after a backoff
+//
+void Source::lostpfd( const Timestamp &now ) {
+    if( heldPtr ) {
+        lineTime = now.monotonic;
+        printpfd( heldPtr, heldLength );
+        heldPtr = NULL;
+    }
+
+    if( !option.reopen ) {
+        fprintf( stderr, "EOF: %s\n", pathname );
+        loop->backend.remove( index );           // disable polling fd
+        return;
+    }
+
+    fprintf( stderr, "Lost: %s\n", pathname );
+    const int fd = loop->pfd[index].fd;
+    loop->backend.remove( index );
+    close( fd );
+    loop->pfd[index].revents = 0;
+
+    free( lineOffset );
+    lineOffset = NULL;
+
+    // keep the printed line for --unique and drop any partial line
+    if( !gpio ) {
+        wrappfd();
+        readEnd = 0;
+    }
+
+    reopening = true;
+    backoff = reopenBackoffMin;
+    loop->timers.schedule( index, now.monotonic + backoff );
+};
+
+
+
+//
+// try to reopen a lost file, backing off further if it's still missing
+//
+void Source::reopenpfd( const Timestamp &now ) {
+    if( devicepfd() ) {
+        if( loop->backend.add( index ) ) {
+            fprintf( stderr, "Reopened: %s\n", pathname );
+            reopening = false;
+            loop->timers.cancel( index );
+            valuepfd( now );
+            return;
+        }
+        close( loop->pfd[index].fd );
+        loop->pfd[index].fd = -1;
+        free( lineOffset );
+        lineOffset = NULL;
+    }
+
+    backoff = std::min( backoff * 2, reopenBackoffMax );
+    loop->timers.schedule( index, now.monotonic + backoff );
+};
+
+
+
+//
+// change the options of an open file, keeping its ring, readTime and
+// debounce state
+// returns false if the new options can't apply to the file
+//
+bool Source::retunepfd( const PFDOption &newOption ) {
+    if( newOption.lineMax != option.lineMax ) {
+        fprintf( stderr, "Can't change max-line: %s\n", pathname );
+        return false;
+    }
+
+    if( newOption.decoder && newOption.decoder->longest() > option.lineMax ) {
+        fprintf( stderr, "Record longer than max-line: %s\n", pathname );
+        return false;
+    }
+
+    if( newOption.quadrature && !(gpio && lineCount == 2) ) {
+        fprintf( stderr, "Quadrature needs two gpio lines: %s\n", pathname );
+        return false;
+    }
+
+    if( newOption.quadrature != option.quadrature ) {
+        quadratureCount = 0;
+    }
+
+    const bool watched = option.reopen;
+    option = newOption;
+    if( !watched ) {
+        watchpfd();
+    }
+    return true;
+};
+
+
+
+//
+// announce a newly opened file (binary mode) and report a gpiochip's
+// starting value
+//
+void Source::startpfd( const Timestamp &now ) {
+    if( loop->output.isBinary() ) {
+        announcepfd();
+    }
+
+    if( loop->recorder ) {
+        loop->recorder->write( frameSource, index, 0, pathname, pathLength );
+    }
+
+    if( reopening ) {
+        loop->timers.schedule( index, now.monotonic + backoff );
+
+    } else if( !loop->replaying ) {
+        valuepfd( now );
+    }
+};
+
+
+
+//
+// Check readable data, debounce and held data for uniqueness
+//
+void Source::checkpfd( const Timestamp &now ) {
+    // something appeared in a watched directory
+    if( watcher ) {
+        char events[4096];
+        while( read( loop->pfd[index].fd, events, sizeof( events ) ) > 0 ) {
+            ++counter.reads;
+        }
+        loop->reopenNow( now );
+        return;
+    }
+
+    // the timer for a lost file is for reopening it
+    if( reopening ) {
+        reopenpfd( now );
+        return;
+    }
+
+    // debouncing is done by holding back data instead of printing
+    // which appears within debounce time.  If device is quiet for debounce
+    // time then print the held data if it's different to the last output
+    // otherwise silently discard it
+    //
+    // This method gives quickest response to any change on the device while
+    // dropping bounce information and still reporting final state in case
+    // it differs
+    //
+    // --coalesce and --max-rate hold data in the same way, until the
+    // gate opens
+
+    bool nobounce = Debounce::settled( option, settleTime, now.monotonic );
+
+    // held data from a debounce might need printing
+    if( heldPtr && nobounce && debounce.open( option, now.monotonic ) ) {
+        lineTime = now.monotonic;
+        printpfd( heldPtr, heldLength );
+        heldPtr = NULL;
+    }
+
+    // gpiochip lines deliver edge events rather than data
+    if( gpio ) {
+        if( loop->pfd[index].revents & loop->pfd[index].events ) {
+            edgepfd( now );
+        }
+
+    // if there's data to read then parse it
+    } else if( (loop->pfd[index].revents & loop->pfd[index].events) && readpfd( now ) ) {
+        char *startPtr = ring + lineStart;
+        char *endPtr = ring + readEnd;
+
+        // step through the lines in the buffer
+        while( true ) {
+            size_t length;
+            char *nextPtr;
+            const Decoder::Result result = splitpfd( startPtr, endPtr, length, nextPtr );
+
+            if( result == Decoder::more ) {
+                startPtr = nextPtr;
+                break;
+
+            } else if( result == Decoder::corrupt ) {
+                ++counter.corrupt;
+                startPtr = nextPtr;
+                continue;
+            }
+
+            ++counter.lines;
+            if( control ) {
+                loop->command( startPtr, length );
+
+            } else {
+                bouncepfd( readTime.monotonic );
+                linepfd( startPtr, length, nobounce );
+            }
+
+            startPtr = nextPtr;
+            nobounce = option.debounce == 0;   // in case >1 line in buffer
+        }
+
+        lineStart = startPtr - ring;
+    }
+
+    // if held data then set the time we need to be checked again
+    if( heldPtr ) {
+        loop->timers.schedule( index, debounce.deadline( option, settleTime ) );
+
+    } else {
+        loop->timers.cancel( index );
+    }
+
+    // shouldn't get an end of file unless a device is unplugged
+    if( failed || (loop->pfd[index].revents & POLLHUP) ) {
+        failed = false;
+        lostpfd( now );
+    }
+};
+
+
+
+//
+// find the next line, or decoded record, in [startPtr, endPtr)
+//
+Decoder::Result Source::splitpfd( char *startPtr, char *endPtr, size_t &length, char *&nextPtr ) {
+    if( option.decoder ) {
+        return option.decoder->next( startPtr, endPtr, option.delimiters, option.lineMax, length, nextPtr );
+    }
+
+    // split lines are reported by the statistics (splits=)
+    const Decoder::Result result = option.delimiters->split( startPtr, endPtr, option.lineMax, length, nextPtr );
+    if( result == Decoder::split ) {
+        ++counter.splits;
+    }
+    return result;
+};
+
+
+
+//
+// stamp a read as close to the read as possible or use the wakeup time
+//
+void Source::stamppfd( const Timestamp &now ) {
+    if( option.readStamp && !loop->replaying ) {
+        readTime.read();
+
+    } else {
+        readTime = now;
+    }
+    lineTime = readTime.monotonic;
+    settleTime = readTime.monotonic;
+};
+
+
+
+//
+// write the counters, debounce window and bounce measurements as one
+// line of key=value pairs
+//
+void Source::statspfd( FILE *stream ) {
+    if( !pathname ) {
+        return;
+    }
+
+    fprintf( stream, "file path=%s reads=%lu bytes=%lu lines=%lu emitted=%lu duplicates=%lu holds=%lu coalesced=%lu splits=%lu corrupt=%lu",
+             pathname, counter.reads, counter.bytes, counter.lines, counter.emitted,
+             counter.duplicates, counter.holds, counter.coalesced, counter.splits, counter.corrupt );
+
+    fprintf( stream, " debounce=%llu auto=%d actuations=%lu bounce_lines=%lu bounce_max=%llu bounce=",
+             (unsigned long long)option.debounce, option.debounceAuto,
+             bounce.actuations, bounce.edges, (unsigned long long)bounce.envelopeMax );
+
+    for( unsigned int bucket = 0; bucket < bounceBuckets; ++bucket ) {
+        fprintf( stream, bucket ? ",%lu" : "%lu", bounce.histogram[bucket] );
+    }
+    fprintf( stream, "\n" );
+};
+
+
+
+//
+// print a line or hold it if bouncing or gated
+//
+void Source::linepfd( char *startPtr, const size_t length, const bool nobounce ) {
+    if( nobounce && debounce.open( option, lineTime ) ) {
+        printpfd( startPtr, length );
+
+    } else {
+        if( heldPtr ) {
+            ++counter.coalesced;
+            ++suppressed;
+        }
+        ++counter.holds;
+        heldPtr = startPtr;
+        heldLength = length;
+    }
+};
+
+
+
+//
+// read a batch of edge events from gpiochip lines.  Each updates the
+// lines' values, which are reported as a decimal bitmask (bit n for the
+// nth line) or decoded as quadrature.
+//
+// Debounce is judged from the edges' kernel timestamps, so a burst read
+// in one go bounces as it happened.  The kernel stamps edges with
+// CLOCK_MONOTONIC rather than our raw clock, so each edge is placed on
+// our clock by its distance back from the batch's last edge, which
+// happened just before the read.  That works the same when replaying.
+//
+void Source::edgepfd( const Timestamp &now ) {
+    const long_time_t previousTime = settleTime;
+    const ssize_t size = inputpfd( loop->gpioEvent, sizeof( loop->gpioEvent ), now );
+    if( size < 0 ) {
+        if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            return;
+
+        } else if( option.reopen ) {
+            perror( pathname );
+            failed = true;
+            return;
+        }
+        perror( "read" );
+        loop->error = true;
+        return;
+    }
+
+    const size_t count = size / sizeof( loop->gpioEvent[0] );
+    ++counter.reads;
+    counter.bytes += size;
+    counter.lines += count;
+    settleTime = previousTime;
+    if( count == 0 ) {
+        return;
+    }
+
+    const long_time_t lastEdge = loop->gpioEvent[count - 1].timestamp_ns;
+    for( size_t event = 0; event < count; ++event ) {
+        unsigned int line = 0;
+        while( line < lineCount && lineOffset[line] != loop->gpioEvent[event].offset ) {
+            ++line;
+        }
+        if( line == lineCount ) {
+            continue;
+        }
+
+        const uint64_t previous = lineBits;
+        if( loop->gpioEvent[event].id == GPIO_V2_LINE_EVENT_RISING_EDGE ) {
+            lineBits |= (uint64_t)1 << line;
+
+        } else {
+            lineBits &= ~((uint64_t)1 << line);
+        }
+
+        edgeTime = loop->gpioEvent[event].timestamp_ns;
+        edgeSequence = loop->gpioEvent[event].seqno;
+        bouncepfd( edgeTime );
+
+        const long_time_t before = lastEdge > edgeTime ? lastEdge - edgeTime : 0;
+        const long_time_t time = readTime.monotonic > before ? readTime.monotonic - before : 0;
+        const bool nobounce = Debounce::settled( option, settleTime, time );
+        settleTime = std::max( settleTime, time );
+
+        if( option.quadrature ) {
+            steppfd( previous, nobounce );
+
+        } else {
+            bitspfd( nobounce );
+        }
+    }
+};
+
+
+
+//
+// print or hold the lines' values as a decimal bitmask, written into a
+// ring slot which isn't holding the printed or held value and hasn't
+// been printed since the output was flushed
+//
+void Source::bitspfd( const bool nobounce ) {
+    // whatever was printed last may have been batched
+    if( printPtr >= ring && printPtr < ring + ringSize ) {
+        slotsUsed |= (uint32_t)1 << ((printPtr - ring) / digitsMax);
+    }
+
+    unsigned int index = 0;
+    while( index < gpioSlots && !freepfd( index ) ) {
+        ++index;
+    }
+
+    // all taken so write the batched values out
+    if( index == gpioSlots ) {
+        loop->output.flush();
+        slotsUsed = 0;
+        index = 0;
+        while( !freepfd( index ) ) {
+            ++index;
+        }
+    }
+    slotsUsed |= (uint32_t)1 << index;
+
+    char *slot = ring + index * digitsMax;
+    char *ptr = slot + digitsMax;
+    uint64_t bits = lineBits;
+    do {
+        *--ptr = '0' + bits % 10;
+        bits /= 10;
+    } while( bits );
+
+    linepfd( ptr, slot + digitsMax - ptr, nobounce );
+};
+
+
+
+//
+// a gpiochip ring slot isn't holding the printed or held value, or
+// one which may still be waiting to be written
+//
+bool Source::freepfd( const unsigned int index ) const {
+    const char *slot = ring + index * digitsMax;
+    return !(slotsUsed & ((uint32_t)1 << index)) &&
+           !(printPtr >= slot && printPtr < slot + digitsMax) &&
+           !(heldPtr >= slot && heldPtr < slot + digitsMax);
+};
+
+
+
+//
+// count an edge of a quadrature pair and print or hold +1 or -1 once
+// enough have been seen in one direction
+//
+void Source::steppfd( const uint64_t previous, const bool nobounce ) {
+    quadratureCount += quadratureTable[quadratureState( previous ) << 2 | quadratureState( lineBits )];
+
+    if( quadratureCount >= (int)option.quadrature ) {
+        quadratureCount = 0;
+        linepfd( stepText + 2, 2, nobounce );
+
+    } else if( quadratureCount <= -(int)option.quadrature ) {
+        quadratureCount = 0;
+        linepfd( stepText, 2, nobounce );
+    }
+};
+
+
+
+//
+// report gpiochip lines' starting values, as reading a /sys value file
+// does on its first wakeup (quadrature only notes the starting state)
+//
+void Source::valuepfd( const Timestamp &now ) {
+    if( gpio ) {
+        struct gpio_v2_line_values values;
+        values.bits = 0;
+        values.mask = lineCount < 64 ? ((uint64_t)1 << lineCount) - 1 : ~(uint64_t)0;
+        if( ioctl( loop->pfd[index].fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values ) < 0 ) {
+            perror( pathname );
+            loop->error = true;
+            return;
+        }
+
+        if( loop->recorder ) {
+            loop->recorder->write( frameValue, index, now.monotonic, values.bits );
+        }
+        setbitspfd( now, values.bits );
+    }
+};
+
+
+
+//
+// start from the lines' values, read or replayed
+//
+void Source::setbitspfd( const Timestamp &now, const uint64_t bits ) {
+    if( gpio ) {
+        lineBits = bits;
+        readTime = now;
+        lineTime = now.monotonic;
+        settleTime = now.monotonic;
+        if( !option.quadrature ) {
+            bitspfd( true );
+        }
+    }
+};
+
+
+
+//
+// copy a line out of the ring to the pin slot the other line isn't using
+//
+void Source::pinpfd( char *&ptr, const size_t length, const char *otherPtr ) {
+    if( length && ptr >= ring && ptr < ring + ringSize ) {
+        char *slot = pin[0] == otherPtr ? pin[1] : pin[0];
+        memcpy( slot, ptr, length );
+        ptr = slot;
+    }
+};
+
+
+
+//
+// move the unfinished line to the start of the ring
+//
+void Source::wrappfd() {
+    // in batch mode the printed line may still be waiting to be written
+    loop->output.flush();
+
+    pinpfd( printPtr, printLength, heldPtr );
+    pinpfd( heldPtr, heldPtr ? heldLength : 0, printPtr );
+
+    readEnd -= lineStart;
+    memmove( ring, ring + lineStart, readEnd );
+    lineStart = 0;
+};
+
+
+
+//
+// read from the file, or take the read being replayed, then stamp it
+// and record it
+//
+ssize_t Source::inputpfd( void *buffer, const size_t size, const Timestamp &now ) {
+    if( loop->replaying ) {
+        const size_t length = std::min( size, replayLength );
+        if( !length ) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        memcpy( buffer, replayPtr, length );
+        replayPtr += length;
+        replayLength -= length;
+        stamppfd( now );
+        return length;
+    }
+
+    const ssize_t length = read( loop->pfd[index].fd, buffer, size );
+    if( length > 0 ) {
+        stamppfd( now );
+        if( loop->recorder ) {
+            loop->recorder->write( frameRead, index, readTime.monotonic, buffer, length );
+        }
+    }
+    return length;
+};
+
+
+
+//
+// feed a read from the --replay log through checkpfd as if the file
+// had it ready, the ring may take it in pieces
+//
+void Source::replaypfd( const Timestamp &now, const char *data, const size_t length ) {
+    replayPtr = data;
+    replayLength = length;
+
+    size_t left;
+    do {
+        left = replayLength;
+        loop->pfd[index].revents = loop->pfd[index].events;
+        checkpfd( now );
+    } while( replayLength && replayLength < left );
+
+    // a file which is lost or closed takes no more
+    if( replayLength ) {
+        fprintf( stderr, "Not replayed: %lu bytes for %s\n", (unsigned long)replayLength, pathname ? pathname : "closed file" );
+    }
+
+    loop->pfd[index].revents = 0;
+    replayLength = 0;
+};
+
+
+
+//
+// read from a pfd
+//
+unsigned int Source::readpfd( const Timestamp &now ) {
+    if( lineStart + option.lineMax >= ringSize ) {
+        wrappfd();
+    }
+
+    if( reseek ) {
+        lseek( loop->pfd[index].fd, 0, SEEK_SET );
+    }
+
+    const int charCount = inputpfd( ring + readEnd, ringSize - readEnd, now );
+    if( charCount < 0 ) {
+        if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            return 0;
+
+        } else if( option.reopen ) {
+            perror( pathname );
+            failed = true;
+            return 0;
+
+        } else {
+            perror( "read" );
+            loop->error = true;
+            return 0;
+        }
+    }
+
+    readEnd += charCount;
+    ++counter.reads;
+    counter.bytes += charCount;
+    return charCount;
+};
+
+
+
+//
+// print and update printPtr to point to what we just printed
+//
+void Source::printpfd( char *startPtr, const size_t length ) {
+    if( length && ( option.duplicates || length != printLength || memcmp( printPtr, startPtr, length ) != 0 ) ) {
+        loop->output.start();
+        loop->output.stamp( lineTime );
+
+        if( loop->output.isBinary() ) {
+            loop->output.frame( frameEvent, index, readTime.monotonic, startPtr, length );
+
+        } else {
+            formatpfd( startPtr, length );
+        }
+
+        loop->output.end();
+        printPtr = startPtr;
+        printLength = length;
+        printTime = readTime.monotonic;
+        debounce.emitted( option, lineTime );
+        suppressed = 0;
+        ++counter.emitted;
+
+    } else if( length ) {
+        ++counter.duplicates;
+    }
+};
+
+
+
+//
+// add a line to the output using the format
+//
+void Source::formatpfd( char *startPtr, const size_t length ) {
+    Format::Fields fields;
+    fields.line = startPtr;
+    fields.length = length;
+    fields.path = pathname;
+    fields.pathLength = pathLength;
+    fields.read = &readTime;
+    fields.delta = printTime ? readTime.monotonic - printTime : 0;
+    fields.edgeTime = edgeTime;
+    fields.edgeSequence = edgeSequence;
+    fields.suppressed = suppressed;
+    option.format->write( loop->output, fields );
+};
+
+
+
+//
+// allocate the per file tables in one contiguous block, with a ring for
+// each slot big enough for lines of lineMax, returns false on error
+//
+// source[pfdMax] | timer tables | pfd[pfdMax] | backend tables | rings
+//
+bool EventLoop::init( const nfds_t max, const unsigned int lineMax ) {
+    pfdMax = max;
+    ringStride = Source::ringBytes( lineMax );
+    const size_t sourceSize = sizeof( Source ) * pfdMax;
+    const size_t timerSize = Timers::tableSize( pfdMax );
+    const size_t pollSize = sizeof( struct pollfd ) * pfdMax;
+    const size_t backendSize = Backend::tableSize( pfdMax );
+
+    char *block = (char *)malloc( sourceSize + timerSize + pollSize + backendSize + ringStride * pfdMax );
+    if( !block && pfdMax ) {
+        perror( "malloc" );
+        return false;
+    }
+
+    source = (Source *)block;
+    timers.tables( block + sourceSize, pfdMax );
+    pfd = (struct pollfd *)(block + sourceSize + timerSize);
+    backend.tables( block + sourceSize + timerSize + pollSize, pfd, pfdMax );
+    rings = block + sourceSize + timerSize + pollSize + backendSize;
+    return true;
+};
+
+
+
+//
+// share a started loop's sources as a --threads worker, checking those
+// whose index % shards == shard with its own epoll backend, timers and
+// output, returns false on error
+//
+bool EventLoop::share( EventLoop &main, const nfds_t shard, const nfds_t shards ) {
+    pfdMax = main.pfdMax;
+    pfdCount = main.pfdCount;
+    pfd = main.pfd;
+    source = main.source;
+    recorder = main.recorder;
+
+    const size_t timerSize = Timers::tableSize( pfdMax );
+    char *block = (char *)malloc( timerSize + Backend::tableSize( pfdMax ) );
+    if( !block && pfdMax ) {
+        perror( "malloc" );
+        return false;
+    }
+    timers.tables( block, pfdMax );
+    backend.tables( block + timerSize, pfd, pfdMax );
+    output.setBinary( main.output.isBinary() );
+
+    for( nfds_t pfdIndex = shard; pfdIndex < pfdCount; pfdIndex += shards ) {
+        source[pfdIndex].setLoop( this );
+    }
+    return backend.select( "epoll" ) && backend.start( pfdCount, shard, shards );
+};
+
+
+
+//
+// find a free slot, returns pfdMax if there isn't one
+//
+nfds_t EventLoop::freeSlot( const char *pathname ) {
+    nfds_t pfdIndex = 0;
+    while( pfdIndex < pfdCount && source[pfdIndex].isOpen() ) {
+        ++pfdIndex;
+    }
+
+    if( pfdIndex == pfdMax ) {
+        fprintf( stderr, "No room for: %s\n", pathname );
+    }
+    return pfdIndex;
+};
+
+
+
+//
+// open a file in a free slot with options, the pathname must outlive it
+// returns its index or pfdMax on error
+//
+nfds_t EventLoop::add( char *pathname, const PFDOption &option ) {
+    const nfds_t pfdIndex = freeSlot( pathname );
+    if( pfdIndex == pfdMax ) {
+        return pfdMax;
+    }
+
+    if( !source[pfdIndex].openpfd( this, pfdIndex, pathname, &option ) ) {
+        return pfdMax;
+    }
+
+    if( pfdIndex == pfdCount ) {
+        ++pfdCount;
+    }
+    return pfdIndex;
+};
+
+
+
+//
+// find an open file by pathname, returns pfdMax if not found
+//
+nfds_t EventLoop::find( const char *pathname ) {
+    for( nfds_t pfdIndex = 0; pfdIndex < pfdCount; ++pfdIndex ) {
+        if( source[pfdIndex].isNamed( pathname ) ) {
+            return pfdIndex;
+        }
+    }
+
+    fprintf( stderr, "Not found: %s\n", pathname );
+    return pfdMax;
+};
+
+
+
+//
+// start checking a file added after listen(), returns false (having
+// closed it) on error
+//
+bool EventLoop::attach( const nfds_t pfdIndex, const Timestamp &now ) {
+    if( !backend.add( pfdIndex ) ) {
+        source[pfdIndex].closepfd();
+        return false;
+    }
+
+    source[pfdIndex].startpfd( now );
+    return true;
+};
+
+
+
+//
+// stop checking a file and close it
+//
+void EventLoop::remove( const nfds_t pfdIndex ) {
+    source[pfdIndex].closepfd();
+};
+
+
+
+//
+// open a fifo whose lines are commands for a listener, rather than
+// lines to output, returns false on error
+//
+bool EventLoop::control( char *pathname, Listener *commands ) {
+    PFDOption option;
+    option.init();
+
+    const nfds_t pfdIndex = add( pathname, option );
+    if( pfdIndex == pfdMax ) {
+        return false;
+    }
+
+    source[pfdIndex].setControl();
+    listener = commands;
+    return true;
+};
+
+
+
+//
+// open the inotify descriptor (see watch()) as a file so it is waited
+// for with the others
+//
+void EventLoop::watcher() {
+    if( inotifyFd < 0 || !pfdCount ) {
+        return;
+    }
+
+    const nfds_t pfdIndex = freeSlot( "inotify" );
+    source[pfdIndex].openwatcher( this, pfdIndex );
+    if( pfdIndex == pfdCount ) {
+        ++pfdCount;
+    }
+};
+
+
+
+//
+// start the opened files: announce them (binary mode) and report the
+// starting values of gpiochip lines
+//
+void EventLoop::start( const Timestamp &now ) {
+    for( nfds_t pfdIndex = 0; pfdIndex < pfdCount; ++pfdIndex ) {
+        source[pfdIndex].startpfd( now );
+    }
+    output.flush();
+};
+
+
+
+//
+// check the files which are ready and those with expired timers, then
+// write what they printed, returns false if the loop has failed
+//
+bool EventLoop::check( Timestamp &now ) {
+    now.read();
+
+    for( nfds_t readyIndex = 0; readyIndex < backend.count(); ++readyIndex ) {
+        const nfds_t pfdIndex = backend.index( readyIndex );
+        source[pfdIndex].checkpfd( now );
+        pfd[pfdIndex].revents = 0;
+    }
+
+    // devices with expired debounce deadlines print their held data and
+    // leave the timer heap
+    while( timers.next() <= now.monotonic ) {
+        source[timers.first()].checkpfd( now );
+    }
+
+    output.flush();
+    return !failed() && (!recorder || recorder->flush());
+};
+
+
+
+//
+// wait for files to be ready, the next timer or until (monotonic), then
+// check them, returns false if the loop has failed
+//
+bool EventLoop::run( Timestamp &now, const long_time_t until ) {
+    const long_time_t next = std::min( timers.next(), until );
+    const long_time_t timeout = next == FOREVER ? FOREVER : next > now.monotonic ? next - now.monotonic : 0;
+
+    return backend.wait( timeout, pfdCount ) && check( now );
+};
+
+
+
+//
+// try to reopen every lost file now
+//
+void EventLoop::reopenNow( const Timestamp &now ) {
+    for( nfds_t pfdIndex = 0; pfdIndex < pfdCount; ++pfdIndex ) {
+        source[pfdIndex].wakepfd( now );
+    }
+};
+
+
+
+//
+// run a line read from the control fifo
+//
+void EventLoop::command( const char *line, const size_t length ) {
+    if( listener ) {
+        listener->command( *this, line, length );
+    }
+};
+
+
+
+//
+// write periodically to a file or fifo, a fifo with no reader just
+// fills and further records are dropped, returns false on error
+//
+// Records are formatted in memory and written whole, so a full fifo
+// never leaves half of one for its reader
+//
+bool Stats::setFile( const char *name ) {
+    fd = open( name, O_RDWR | O_CREAT | O_APPEND | O_NONBLOCK, 0644 );
+    if( fd < 0 || !(file = open_memstream( &record, &recordLength )) ) {
+        perror( name );
+        return false;
+    }
+    return true;
+};
+
+
+
+//
+// write the periodic statistics if they are due
+//
+void Stats::check( EventLoop &loop, const long_time_t now ) {
+    if( now >= next ) {
+        // a record cut short by a full fifo is finished before another
+        // is started, the ones due meanwhile are dropped
+        if( recordWritten == recordLength ) {
+            rewind( file );
+            write( loop, file );
+            recordWritten = 0;
+        }
+        send();
+        next = now + interval;
+    }
+};
+
+
+
+//
+// write as much of the record as the file will take
+//
+void Stats::send() {
+    while( recordWritten < recordLength ) {
+        const ssize_t written = ::write( fd, record + recordWritten, recordLength - recordWritten );
+        if( written < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            return;
+        }
+        recordWritten += written;
+    }
+};
+
+
+
+//
+// write all the statistics
+//
+void Stats::write( EventLoop &loop, FILE *stream ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    fprintf( stream, "stats time=%llu files=%lu\n", (unsigned long long)Timestamp::nanoseconds( ts ), (unsigned long)loop.pfdCount );
+
+    for( nfds_t pfdIndex = 0; pfdIndex < loop.pfdCount; ++pfdIndex ) {
+        loop.source[pfdIndex].statspfd( stream );
+    }
+
+    loop.output.latency.write( stream, "latency" );
+    wakeup.write( stream, "wakeup" );
+    fprintf( stream, "\n" );
+    fflush( stream );
+};
+
+
+
+//
+// a worker's loop, checking its shard of the main loop's files until it
+// fails
+//
+void *Workers::run( const unsigned int shard ) {
+    EventLoop &loop = loops[shard];
+    if( loop.share( *main, shard, count ) ) {
+        loop.output.setSink( &queue );
+
+        Timestamp now;
+        now.read();
+        while( loop.run( now ) ) {
+        }
+    }
+
+    // the main thread gives up
+    __atomic_store_n( &error, true, __ATOMIC_SEQ_CST );
+    queue.wake();
+    return NULL;
+};
+
+
+
+//
+// gather the earliest waiting line for the next flush
+//
+void Workers::pop() {
+    Entry *entry = heap[0];
+    std::pop_heap( heap, heap + heapCount--, later );
+
+    main->output.start();
+    main->output.stamp( entry->time );
+    main->output.span( entry->data, entry->length );
+    main->output.end();
+    written[writtenCount++] = entry;
+};
+
+
+
+//
+// write the gathered lines and free their entries
+//
+void Workers::flush() {
+    main->output.flush();
+    while( writtenCount ) {
+        free[freeCount++] = written[--writtenCount];
+    }
+};
+
+
+
+//
+// undo a start which failed: stop and join the workers which were
+// created, give their files back to the main loop and free the tables
+//
+void Workers::abandon( pthread_t *threads, const unsigned int running, Entry *pool ) {
+    // the workers wait in poll or epoll_wait, which are cancellation points
+    for( unsigned int worker = 0; worker < running; ++worker ) {
+        pthread_cancel( threads[worker] );
+        pthread_join( threads[worker], NULL );
+    }
+    for( nfds_t pfdIndex = 0; pfdIndex < main->pfdCount; ++pfdIndex ) {
+        main->source[pfdIndex].setLoop( main );
+    }
+
+    delete[] loops;
+    loops = NULL;
+    ::free( pool );
+    ::free( heap );
+    heap = NULL;
+    ::free( threads );
+    queue.freeSlots();
+};
+
+
+
+//
+// allocate the tables and start the workers on a started loop's files,
+// SIGUSR1 stays with the calling thread, returns false on error
+//
+bool Workers::start( EventLoop &loop ) {
+    main = &loop;
+    if( !queue.init() ) {
+        return false;
+    }
+
+    Entry *pool = (Entry *)malloc( sizeof( Entry ) * queueSlots );
+    heap = (Entry **)malloc( sizeof( Entry * ) * queueSlots * 3 );
+    pthread_t *threads = (pthread_t *)malloc( sizeof( pthread_t ) * count );
+    if( !pool || !heap || !threads ) {
+        perror( "malloc" );
+        abandon( threads, 0, pool );
+        return false;
+    }
+    loops = new EventLoop[count];
+
+    free = heap + queueSlots;
+    written = free + queueSlots;
+    for( freeCount = 0; freeCount < queueSlots; ++freeCount ) {
+        free[freeCount] = pool + freeCount;
+    }
+
+    sigset_t mask;
+    sigset_t saved;
+    sigemptyset( &mask );
+    sigaddset( &mask, SIGUSR1 );
+    pthread_sigmask( SIG_BLOCK, &mask, &saved );
+
+    unsigned int running;
+    for( running = 0; running < count; ++running ) {
+        const int result = pthread_create( threads + running, NULL, work, this );
+        if( result ) {
+            errno = result;
+            perror( "pthread_create" );
+            break;
+        }
+    }
+
+    pthread_sigmask( SIG_SETMASK, &saved, NULL );
+    if( running < count ) {
+        abandon( threads, running, pool );
+        return false;
+    }
+
+    ::free( threads );
+    main->output.setBatch( true );
+    return true;
+};
+
+
+
+//
+// the main thread's loop: wait for the workers' lines, the next line
+// to leave the reorder window or until (monotonic), then merge the
+// lines and write them, returns false if a loop has failed
+//
+bool Workers::run( Timestamp &now, const long_time_t until ) {
+    const long_time_t next = std::min( heapCount ? heap[0]->time + window : FOREVER, until );
+    queue.wait( seen, next == FOREVER ? FOREVER : next > now.monotonic ? next - now.monotonic : 0 );
+
+    seen = queue.sequence();
+
+    Queue::Slot *slot;
+    while( (slot = queue.peek()) ) {
+        // no room to wait so write the earliest now
+        if( !freeCount ) {
+            pop();
+            flush();
+        }
+
+        Entry *entry = free[--freeCount];
+        entry->time = slot->time;
+        entry->sequence = arrivals++;
+        entry->length = slot->length;
+        memcpy( entry->data, slot->data, slot->length );
+        queue.release();
+
+        heap[heapCount++] = entry;
+        std::push_heap( heap, heap + heapCount, later );
+    }
+
+    now.read();
+    while( heapCount && heap[0]->time + window <= now.monotonic ) {
+        pop();
+    }
+    flush();
+
+    return !__atomic_load_n( &error, __ATOMIC_SEQ_CST ) && !main->failed();
+};
+
+
+
+//
+// read the next frame, returns false at the end of the log
+//
+bool Replay::next( uint16_t &type, uint16_t &index, long_time_t &time, uint32_t &length ) {
+    uint8_t header[frameHeaderSize];
+    if( fread( header, frameHeaderSize, 1, file ) != 1 ) {
+        return false;
+    }
+
+    type = decodeLittle( header, 2 );
+    index = decodeLittle( header + 2, 2 );
+    length = decodeLittle( header + 4, 4 );
+    time = decodeLittle( header + 8, 8 );
+
+    if( length > payloadSize ) {
+        char *larger = (char *)realloc( payload, length );
+        if( !larger ) {
+            perror( "malloc" );
+            return false;
+        }
+        payload = larger;
+        payloadSize = length;
+    }
+
+    if( length && fread( payload, length, 1, file ) != 1 ) {
+        fprintf( stderr, "Replay log truncated\n" );
+        return false;
+    }
+    return true;
+};
+
+
+
+//
+// wait until a log time is due at the replay speed
+//
+void Replay::pace( const long_time_t time ) {
+    if( speed <= 0 ) {
+        return;
+    }
+
+    if( !started ) {
+        started = true;
+        startTime = time;
+        clock_gettime( CLOCK_MONOTONIC, &startReal );
+        return;
+    }
+
+    const long_time_t real = Timestamp::nanoseconds( startReal ) + (long_time_t)((time - startTime) / speed);
+    struct timespec ts;
+    ts.tv_sec = real / 1000000000;
+    ts.tv_nsec = real % 1000000000;
+    while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR ) {
+    }
+};
+
+
+
+//
+// set now to a log time, which never goes backwards
+//
+void Replay::at( Timestamp &now, const long_time_t time ) {
+    if( time > now.monotonic ) {
+        pace( time );
+        now.monotonic = time;
+    }
+    now.epoch = clockEpoch + now.monotonic - clockMonotonic;
+};
+
+
+
+//
+// expire the timers due up to a log time
+//
+void Replay::expire( EventLoop &loop, Timestamp &now, const long_time_t time ) {
+    while( loop.timers.next() != FOREVER && loop.timers.next() <= time ) {
+        at( now, loop.timers.next() );
+        while( loop.timers.next() <= now.monotonic ) {
+            loop.source[loop.timers.first()].checkpfd( now );
+        }
+        loop.output.flush();
+    }
+};
+
+
+
+//
+// replay a log, returns false on error
+//
+bool Replay::open( const char *name ) {
+    if( !(file = fopen( name, "r" )) ) {
+        perror( name );
+        return false;
+    }
+    return true;
+};
+
+
+
+//
+// start replaying through a started loop, returns false on error
+//
+bool Replay::start( EventLoop &loop, Timestamp &now ) {
+    source = (nfds_t *)malloc( sizeof( nfds_t ) * 65536 );
+    if( !source ) {
+        perror( "malloc" );
+        return false;
+    }
+    for( unsigned int index = 0; index < 65536; ++index ) {
+        source[index] = loop.pfdMax;
+    }
+
+    now.clear();
+    return true;
+};
+
+
+
+//
+// replay the next frame, returns false once the log is finished, with
+// the remaining timers expired, or the loop has failed
+//
+bool Replay::step( EventLoop &loop, Timestamp &now ) {
+    uint16_t type;
+    uint16_t index;
+    long_time_t time;
+    uint32_t length;
+    if( !next( type, index, time, length ) ) {
+        expire( loop, now, FOREVER );
+        loop.output.flush();
+        return false;
+    }
+
+    if( type == frameSource ) {
+        nfds_t pfdIndex = 0;
+        while( pfdIndex < loop.pfdCount && !loop.source[pfdIndex].isNamed( payload, length ) ) {
+            ++pfdIndex;
+        }
+        if( pfdIndex == loop.pfdCount ) {
+            fprintf( stderr, "Not replayed: %.*s\n", (int)length, payload );
+            pfdIndex = loop.pfdMax;
+        }
+        source[index] = pfdIndex;
+        return true;
+    }
+
+    if( type == frameClock && length == 8 ) {
+        clockMonotonic = time;
+        clockEpoch = decodeLittle( (uint8_t *)payload, 8 );
+    }
+
+    expire( loop, now, time );
+    at( now, time );
+
+    if( source[index] != loop.pfdMax ) {
+        if( type == frameRead ) {
+            loop.source[source[index]].replaypfd( now, payload, length );
+
+        } else if( type == frameValue && length == 8 ) {
+            loop.source[source[index]].setbitspfd( now, decodeLittle( (uint8_t *)payload, 8 ) );
+        }
+    }
+    loop.output.flush();
+    return !loop.failed();
+};
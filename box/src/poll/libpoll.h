@@ -0,0 +1,2740 @@
+//
+// Copyright 2013,2014,2015 Tarim
+//
+// Poll is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Poll is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with Poll.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Libpoll is the input engine of poll, for programs which want poll's
+// lines without the pipe.  An EventLoop waits on a set of Sources:
+// character devices, named pipes, /sys/class/gpio/gpioX/value style files
+// and gpiochip lines.  Each source's input goes through stages which can
+// also be used on their own:
+//
+// Delimiters   split input into lines (or a Decoder into records)
+// Debounce     hold lines while bouncing, coalescing or rate limited
+// Format       add a line's fields to an Output
+//
+// Output writes the lines to stdout, a shared memory ring or a Sink, and
+// a Listener takes the lines of a --control fifo.  Those are the points
+// to extend: Source is one class for every kind of file, not an interface.
+// Nothing is global and nothing exits: errors are reported on stderr and
+// returned.
+//
+// The stages are defined here, inline, as they run for every line.  The
+// engine behind them, sources, event loop, statistics, workers and replay,
+// is in libpoll.cc which is linked with the program.
+//
+
+//
+// Philosophy:
+// As poll is generally responding to real-time events; it tries to be
+// as time efficient as possible.  String handling is all C style rather
+// than C++ Strings. There is no mallocing of space (there may be some
+// within library routines but we have no control of this) and no dynamic
+// creation of class instances during the main loop.  The per file tables,
+// with a ring buffer for each file, are sized from the arguments and
+// allocated once, in a single block, before the main loop starts.
+//
+// Input lines are read into a pre-allocated ring buffer per file and
+// gathered, without copying, for sending on their way in an atomic
+// operation.
+//
+
+#ifndef POLL_LIBPOLL_H
+#define POLL_LIBPOLL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <linux/gpio.h>
+#include "ring.h"
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#elif defined( __ARM_NEON )
+#include <arm_neon.h>
+#endif
+
+
+
+// Default maximum line length
+const unsigned int lineMaxDefault = 1022;
+
+// Each file's ring buffer holds this many maximum length lines
+const unsigned int ringLines = 4;
+
+// Nanoseconds since Unix Epoch or since boot
+typedef uint64_t long_time_t;
+const long_time_t FOREVER = -1;
+const long_time_t MILLISECOND = 1000000;
+
+// % options in format strings
+const char formatChr[] = "lptTdknc";
+
+// Most delimiters which are compared a vector at a time (more use the table)
+const unsigned int delimiterVectorMax = 8;
+
+// Maximum number of literal and % parts in a format string
+const unsigned int formatOpMax = 64;
+
+// Maximum number of decimal digits in a long_time_t
+const unsigned int digitsMax = 20;
+
+// Binary output frame, all fields little-endian:
+//   uint16 type        frameSource or frameEvent
+//   uint16 source      index of the file in the arguments
+//   uint32 length      payload length in bytes
+//   uint64 time        monotonic nanoseconds
+//   payload            pathname (frameSource) or line (frameEvent)
+const unsigned int frameHeaderSize = 16;
+const uint16_t frameSource = 0;
+const uint16_t frameEvent = 1;
+
+// Most files a frame's source index can number
+const nfds_t frameSourceMax = 65536;
+
+// A --record log is frames too, starting with a frameClock and a
+// frameSource for each file:
+//   frameRead          bytes read from the file, at the time of the read
+//   frameValue         gpiochip lines' values when opened, 8 byte payload
+//   frameClock         epoch nanoseconds at the frame's time, 8 byte payload
+const uint16_t frameRead = 2;
+const uint16_t frameValue = 3;
+const uint16_t frameClock = 4;
+
+// stdio buffer for the --record log, written at the end of each wakeup
+const size_t recordBuffer = 65536;
+
+// Space for decimal digits or a frame header
+const unsigned int scratchMax = digitsMax > frameHeaderSize ? digitsMax : frameHeaderSize;
+
+// Adaptive debounce (--debounce auto)
+// Bounce envelopes (first to last line of an actuation) are counted in
+// power of two buckets from bounceBucketBase.  Lines further apart than
+// debounceAutoMax belong to separate actuations.
+const unsigned int bounceBuckets = 10;
+const long_time_t bounceBucketBase = 128000;            // 128us
+const long_time_t debounceAutoMin = MILLISECOND;
+const long_time_t debounceAutoMax = 50 * MILLISECOND;
+
+// Histograms have histogramSub buckets for each power of two, so values
+// are recorded to within 1/histogramSub (6%)
+const unsigned int histogramSubBits = 4;
+const unsigned int histogramSub = 1 << histogramSubBits;
+const unsigned int histogramBuckets = histogramSub * (64 - histogramSubBits + 1);
+
+// Default time between writes to a --stats file
+const long_time_t statsIntervalDefault = 10000 * MILLISECOND;
+
+// Time between attempts to reopen a lost file (--reopen), doubling from
+// reopenBackoffMin up to reopenBackoffMax
+const long_time_t reopenBackoffMin = 100 * MILLISECOND;
+const long_time_t reopenBackoffMax = 10000 * MILLISECOND;
+
+// 125kHz RFID reader frames (--decode rfid125): STX, 10 data and 2
+// checksum hex digits, perhaps CR LF, then ETX.  Readers without STX and
+// ETX send the digits, with or without the checksum, on a line
+const char rfidStart = '\002';
+const char rfidEnd = '\003';
+const unsigned int rfidDigits = 12;
+const unsigned int rfidDataDigits = 10;
+const size_t rfidFrameMax = 1 + rfidDigits + 2 + 1;
+
+// Digits for normalized hex records
+const char hexDigits[] = "0123456789ABCDEF";
+
+// Most worker threads (--threads)
+const unsigned int threadsMax = 64;
+
+// Lines queued between the worker threads and the writer, each at most
+// queueRecordMax bytes
+const unsigned int queueSlots = 256;
+const size_t queueRecordMax = PIPE_BUF;
+
+// Default time a line from a worker waits to be merged in time order
+const long_time_t reorderDefault = 5 * MILLISECOND;
+
+// Most gpiochip edge events taken by one read
+const unsigned int gpioEventMax = 16;
+
+// Number of value slots in a gpiochip source's ring: a read's edges plus the
+// printed and held values, batched output may point at any of them
+const unsigned int gpioSlots = gpioEventMax + 2;
+
+// Lines output for quadrature steps: "-1" and "+1"
+extern char stepText[];
+
+// Quadrature step for a change from the previous (AB) to the current (AB)
+// state, indexed by previous << 2 | current
+const signed char quadratureTable[16] = { 0, +1, -1, 0, -1, 0, 0, +1, +1, 0, 0, -1, 0, -1, +1, 0 };
+
+
+
+//
+// Timestamp class
+//
+// A pair of times taken together:
+// monotonic: CLOCK_MONOTONIC_RAW, used for debounce and interval arithmetic
+//            as it never jumps or slews with NTP
+// epoch:     CLOCK_REALTIME, only used for reporting (%t)
+//
+class Timestamp {
+public:
+    long_time_t monotonic;      // Nanoseconds since boot
+    long_time_t epoch;          // Nanoseconds since Unix Epoch
+
+    //
+    // convert a timespec to nanoseconds
+    //
+    static long_time_t nanoseconds( const struct timespec &ts ) {
+        return (long_time_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    };
+
+
+
+    //
+    // read both clocks
+    //
+    void read() {
+        struct timespec ts;
+
+        clock_gettime( CLOCK_MONOTONIC_RAW, &ts );
+        monotonic = nanoseconds( ts );
+
+        clock_gettime( CLOCK_REALTIME, &ts );
+        epoch = nanoseconds( ts );
+    };
+
+
+
+    //
+    // set both times to zero (never)
+    //
+    void clear() {
+        monotonic = 0;
+        epoch = 0;
+    };
+};
+
+
+
+//
+// Histogram class
+//
+// HDR style histogram of nanosecond times: log-linear buckets give the
+// same relative precision from nanoseconds to years in a fixed table and
+// recording a value is a couple of shifts.
+//
+class Histogram {
+private:
+    uint64_t bucket[histogramBuckets];
+    uint64_t total;
+    long_time_t max;
+
+    //
+    // bucket index of a value
+    //
+    static unsigned int index( const long_time_t value ) {
+        if( value < histogramSub ) {
+            return value;
+        }
+        const unsigned int exponent = 63 - __builtin_clzll( value );
+        return (exponent - histogramSubBits + 1) * histogramSub + ((value >> (exponent - histogramSubBits)) & (histogramSub - 1));
+    };
+
+
+
+    //
+    // lowest value in a bucket
+    //
+    static long_time_t lowest( const unsigned int index ) {
+        if( index < histogramSub ) {
+            return index;
+        }
+        const unsigned int exponent = index / histogramSub + histogramSubBits - 1;
+        return (long_time_t)(histogramSub + index % histogramSub) << (exponent - histogramSubBits);
+    };
+
+
+
+public:
+    Histogram() {
+        memset( bucket, 0, sizeof( bucket ) );
+        total = 0;
+        max = 0;
+    };
+
+
+
+    //
+    // add a value
+    //
+    void record( const long_time_t value ) {
+        ++bucket[index( value )];
+        ++total;
+        max = std::max( max, value );
+    };
+
+
+
+    //
+    // highest value (to the histogram's precision) of the lowest perMillion
+    // millionths of the values
+    //
+    long_time_t percentile( const uint64_t perMillion ) {
+        const uint64_t target = (total * perMillion + 999999) / 1000000;
+        uint64_t count = 0;
+        for( unsigned int index = 0; index < histogramBuckets - 1; ++index ) {
+            count += bucket[index];
+            if( count >= target ) {
+                return std::min( lowest( index + 1 ) - 1, max );
+            }
+        }
+        return max;
+    };
+
+
+
+    //
+    // write as one line of name key=value pairs
+    //
+    void write( FILE *stream, const char *name ) {
+        fprintf( stream, "%s count=%llu p50=%llu p90=%llu p99=%llu p999=%llu max=%llu\n", name,
+                 (unsigned long long)total,
+                 (unsigned long long)percentile( 500000 ), (unsigned long long)percentile( 900000 ),
+                 (unsigned long long)percentile( 990000 ), (unsigned long long)percentile( 999000 ),
+                 (unsigned long long)max );
+    };
+};
+
+
+
+//
+// little-endian fields of binary frames and --record logs
+//
+inline void encodeLittle( uint8_t *ptr, const uint64_t value, const unsigned int bytes ) {
+    for( unsigned int byte = 0; byte < bytes; ++byte ) {
+        ptr[byte] = value >> (8 * byte);
+    }
+};
+
+inline uint64_t decodeLittle( const uint8_t *ptr, const unsigned int bytes ) {
+    uint64_t value = 0;
+    for( unsigned int byte = bytes; byte-- > 0; ) {
+        value = value << 8 | ptr[byte];
+    }
+    return value;
+};
+
+
+
+//
+// write a frame header, frameHeaderSize bytes
+//
+inline void encodeFrame( uint8_t *header, const uint16_t type, const uint16_t source, const long_time_t time, const uint32_t length ) {
+    encodeLittle( header, type, 2 );
+    encodeLittle( header + 2, source, 2 );
+    encodeLittle( header + 4, length, 4 );
+    encodeLittle( header + 8, time, 8 );
+};
+
+
+
+//
+// Sink class
+//
+// Takes an Output's lines in place of stdout, so poll can be embedded
+// without a pipe.  write() is given each write's lines, as iovecs which
+// are only valid for the call, and the read time of the oldest.
+//
+class Sink {
+public:
+    virtual ~Sink() {};
+
+    virtual void write( const struct iovec *vec, const int count, const long_time_t time ) = 0;
+};
+
+
+
+//
+// Queue class
+//
+// A bounded lock-free queue carrying lines from the --threads workers
+// (any number of producers) to the writer (one consumer).  Each slot has
+// a sequence number, as in Vyukov's bounded queue, so a producer claims a
+// slot with one compare-and-swap and never waits for another producer.
+// A producer finding the queue full yields until the writer catches up,
+// which is the same back pressure a full stdout pipe gives.
+//
+// The writer sleeps on a futex which producers only wake when it is
+// waiting, as with the shared memory ring.
+//
+class Queue : public Sink {
+public:
+    struct Slot {
+        uint64_t sequence;      // pos + 1 when filled, pos + queueSlots when free again
+        long_time_t time;       // read time of the line
+        uint32_t length;
+        char data[queueRecordMax];
+    };
+
+private:
+    Slot *slots;                // slots[queueSlots]
+    uint64_t tail;              // next position for producers
+    uint64_t head;              // next position for the consumer
+    uint32_t published;         // futex word, bumped for every line
+    uint32_t waiting;           // the consumer is sleeping on published
+
+public:
+    //
+    // constructor
+    //
+    Queue() {
+        slots = NULL;
+        tail = 0;
+        head = 0;
+        published = 0;
+        waiting = 0;
+    };
+
+
+
+    //
+    // allocate the slots, before any worker starts, returns false on error
+    //
+    bool init() {
+        slots = (Slot *)malloc( sizeof( Slot ) * queueSlots );
+        if( !slots ) {
+            perror( "malloc" );
+            return false;
+        }
+
+        for( uint64_t pos = 0; pos < queueSlots; ++pos ) {
+            slots[pos].sequence = pos;
+        }
+        return true;
+    };
+
+
+
+    //
+    // free the slots, once no worker can push to them
+    //
+    void freeSlots() {
+        free( slots );
+        slots = NULL;
+    };
+
+
+
+    //
+    // copy a set of iovecs into the queue as one line read at time and
+    // wake the consumer, returns false if the line is too long
+    //
+    bool push( const struct iovec *vec, const int count, const long_time_t time ) {
+        size_t length = 0;
+        for( int index = 0; index < count; ++index ) {
+            length += vec[index].iov_len;
+        }
+        if( length > queueRecordMax ) {
+            return false;
+        }
+
+        uint64_t pos = __atomic_load_n( &tail, __ATOMIC_RELAXED );
+        Slot *slot;
+        while( true ) {
+            slot = &slots[pos % queueSlots];
+            const int64_t difference = (int64_t)(__atomic_load_n( &slot->sequence, __ATOMIC_ACQUIRE ) - pos);
+
+            if( difference == 0 ) {
+                if( __atomic_compare_exchange_n( &tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+                    break;
+                }
+
+            } else {
+                // full, or another producer took the slot
+                if( difference < 0 ) {
+                    sched_yield();
+                }
+                pos = __atomic_load_n( &tail, __ATOMIC_RELAXED );
+            }
+        }
+
+        slot->time = time;
+        slot->length = length;
+        char *ptr = slot->data;
+        for( int index = 0; index < count; ++index ) {
+            memcpy( ptr, vec[index].iov_base, vec[index].iov_len );
+            ptr += vec[index].iov_len;
+        }
+
+        __atomic_store_n( &slot->sequence, pos + 1, __ATOMIC_RELEASE );
+        __atomic_add_fetch( &published, 1, __ATOMIC_SEQ_CST );
+        if( __atomic_load_n( &waiting, __ATOMIC_SEQ_CST ) ) {
+            syscall( SYS_futex, &published, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+        }
+        return true;
+    };
+
+
+
+    //
+    // a worker's output
+    //
+    void write( const struct iovec *vec, const int count, const long_time_t time ) {
+        if( !push( vec, count, time ) ) {
+            fprintf( stderr, "Output too long for queue\n" );
+        }
+    };
+
+
+
+    //
+    // the next line or NULL if the queue is empty, release() it when done
+    //
+    Slot *peek() {
+        Slot *slot = &slots[head % queueSlots];
+        return __atomic_load_n( &slot->sequence, __ATOMIC_ACQUIRE ) == head + 1 ? slot : NULL;
+    };
+
+    void release() {
+        __atomic_store_n( &slots[head % queueSlots].sequence, head + queueSlots, __ATOMIC_RELEASE );
+        ++head;
+    };
+
+
+
+    //
+    // count of lines pushed, read before emptying the queue and passed to wait()
+    //
+    uint32_t sequence() {
+        return __atomic_load_n( &published, __ATOMIC_SEQ_CST );
+    };
+
+
+
+    //
+    // wake the consumer without a line, when a producer has failed
+    //
+    void wake() {
+        __atomic_add_fetch( &published, 1, __ATOMIC_SEQ_CST );
+        syscall( SYS_futex, &published, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+    };
+
+
+
+    //
+    // sleep until a line is pushed after seen was read or the timeout
+    // (nanoseconds) passes
+    //
+    void wait( const uint32_t seen, const long_time_t timeout ) {
+        struct timespec ts;
+        ts.tv_sec = timeout / 1000000000;
+        ts.tv_nsec = timeout % 1000000000;
+
+        __atomic_store_n( &waiting, 1, __ATOMIC_SEQ_CST );
+        syscall( SYS_futex, &published, FUTEX_WAIT_PRIVATE, seen, timeout == FOREVER ? NULL : &ts, NULL, 0 );
+        __atomic_store_n( &waiting, 0, __ATOMIC_SEQ_CST );
+    };
+};
+
+
+
+//
+// Output class
+//
+// Each EventLoop has an Output to
+// gather the parts of a line of output, without copying them, and
+// write them all to the output stream with one writev.  This is atomic
+// if the total is no more than PIPE_BUF, which is checked when each file
+// is opened.
+//
+// With a ring (--shm) output is published to shared memory instead of
+// stdout, one record per write.  With a sink each write is handed to it
+// instead.
+//
+// There is one Output per thread.  A --threads worker's Output pushes
+// each line onto the queue, as its sink, for the writer to merge.
+//
+// In binary mode each line is written as a frame (see frameHeaderSize)
+// instead of being formatted.
+//
+// The time from each write's oldest line being read to the write
+// finishing is recorded in latency.
+//
+// In batch mode the lines from a whole wakeup are gathered and written
+// together by flush() at the end of the loop.  Lines are never split
+// between writes: the lines gathered so far are written early if the
+// next line would take the total over PIPE_BUF or fill the iovec table.
+//
+class Output {
+private:
+    static const unsigned int iovMax = IOV_MAX;
+
+    struct iovec iov[iovMax];
+    unsigned int iovCount;
+    size_t iovBytes;
+
+    char scratch[iovMax][scratchMax];   // digits and frame headers
+    unsigned int scratchCount;
+
+    unsigned int lineStart;     // iov index of the line being gathered
+    size_t lineBytes;           // bytes gathered before this line
+
+    bool batch;
+    bool binary;
+    RingWriter *ring;
+    Sink *sink;                 // takes the lines instead of stdout
+    bool replay;                // lines are stamped with a --replay log's clock
+    bool error;                 // a write failed
+
+    long_time_t oldest;         // read time of the oldest line gathered (0 if none)
+    long_time_t newest;         // read time of the latest line
+
+    //
+    // record the latency of a write
+    //
+    void written() {
+        // replayed lines are stamped with the log's clock
+        if( oldest && !replay ) {
+            struct timespec ts;
+            clock_gettime( CLOCK_MONOTONIC_RAW, &ts );
+            latency.record( Timestamp::nanoseconds( ts ) - oldest );
+        }
+        oldest = 0;
+    };
+
+
+
+
+    //
+    // write a set of iovecs to stdout, restarting after a short write
+    //
+    void writeOut( struct iovec *vec, int count ) {
+        if( sink ) {
+            if( count ) {
+                sink->write( vec, count, oldest );
+            }
+            oldest = 0;
+            return;
+        }
+
+        if( ring ) {
+            if( count && !ring->publish( vec, count ) ) {
+                fprintf( stderr, "Output too long for ring\n" );
+            }
+            written();
+            return;
+        }
+
+        while( count > 0 ) {
+            ssize_t written = writev( STDOUT_FILENO, vec, count );
+            if( written < 0 ) {
+                if( errno == EINTR ) {
+                    continue;
+                }
+                perror( "write" );
+                error = true;
+                oldest = 0;
+                return;
+            }
+
+            // skip over what has been written
+            while( count > 0 && (size_t)written >= vec->iov_len ) {
+                written -= vec->iov_len;
+                ++vec;
+                --count;
+            }
+            if( count > 0 ) {
+                vec->iov_base = (char *)vec->iov_base + written;
+                vec->iov_len -= written;
+            }
+        }
+        written();
+    };
+
+
+
+public:
+    Histogram latency;          // Read to write times
+
+    //
+    // constructor
+    //
+    Output() {
+        oldest = 0;
+        newest = 0;
+        iovCount = 0;
+        iovBytes = 0;
+        scratchCount = 0;
+        batch = false;
+        binary = false;
+        ring = NULL;
+        sink = NULL;
+        replay = false;
+        error = false;
+    };
+
+
+
+    //
+    // gather lines until flush() is called
+    //
+    void setBatch( const bool batchMode ) {
+        batch = batchMode;
+    };
+
+
+
+    //
+    // publish to a shared memory ring instead of stdout, returns false on
+    // error
+    //
+    bool setShm( const char *name ) {
+        ring = new RingWriter;
+        if( !ring->create( name ) ) {
+            perror( name );
+            return false;
+        }
+        return true;
+    };
+
+
+
+    //
+    // hand lines to a sink instead of writing them
+    //
+    void setSink( Sink *outputSink ) {
+        sink = outputSink;
+    };
+
+
+
+    //
+    // lines are stamped with a --replay log's clock so have no latency
+    //
+    void setReplay( const bool replayMode ) {
+        replay = replayMode;
+    };
+
+
+
+    //
+    // a write has failed
+    //
+    bool failed() {
+        return error;
+    };
+
+
+
+    //
+    // write frames instead of formatted lines
+    //
+    void setBinary( const bool binaryMode ) {
+        binary = binaryMode;
+    };
+
+    bool isBinary() {
+        return binary;
+    };
+
+
+
+    //
+    // start a new line of output
+    //
+    void start() {
+        // make sure there's room for the longest format, the lines kept
+        // back by a partial batch write keep their scratch entries
+        if( iovCount + formatOpMax > iovMax || scratchCount + formatOpMax > iovMax ) {
+            flush();
+        }
+
+        lineStart = iovCount;
+        lineBytes = iovBytes;
+    };
+
+
+
+    //
+    // note the read time of the line being gathered
+    //
+    void stamp( const long_time_t time ) {
+        if( !oldest || time < oldest ) {
+            oldest = time;
+        }
+        newest = time;
+    };
+
+
+
+    //
+    // Add a span of characters to the output
+    //
+    void span( const char *str, const size_t len ) {
+        if( len ) {
+            iov[iovCount].iov_base = (void *)str;
+            iov[iovCount].iov_len = len;
+            ++iovCount;
+            iovBytes += len;
+        }
+    };
+
+
+
+    //
+    // Add a decimal number to the output
+    //
+    void number( long_time_t val ) {
+        char *end = scratch[scratchCount++] + digitsMax;
+        char *ptr = end;
+
+        do {
+            *--ptr = '0' + val % 10;
+            val /= 10;
+        } while( val );
+
+        span( ptr, end - ptr );
+    };
+
+
+
+    //
+    // Add a frame header and payload to the output
+    //
+    void frame( const uint16_t type, const uint16_t source, const long_time_t time, const char *payload, const uint32_t length ) {
+        uint8_t *header = (uint8_t *)scratch[scratchCount++];
+        encodeFrame( header, type, source, time, length );
+
+        span( (char *)header, frameHeaderSize );
+        span( payload, length );
+    };
+
+
+
+    //
+    // finish a line of output
+    //
+    void end() {
+        if( !batch ) {
+            flush();
+
+        } else if( iovBytes > PIPE_BUF && lineStart > 0 ) {
+            // write the earlier lines and keep this one for later
+            writeOut( iov, lineStart );
+            oldest = newest;
+            memmove( iov, iov + lineStart, sizeof( struct iovec ) * (iovCount - lineStart) );
+            iovCount -= lineStart;
+            iovBytes -= lineBytes;
+        }
+    };
+
+
+
+    //
+    // flush gathered output to stdout
+    //
+    void flush() {
+        writeOut( iov, iovCount );
+        iovCount = 0;
+        iovBytes = 0;
+        scratchCount = 0;
+    };
+};
+
+
+
+//
+// Format class
+//
+// The format stage: a +FORMAT string compiled into a list of operations
+// when the arguments are parsed.  Each operation is either a literal
+// span pointing into the format string or a % code:
+//          l: output line from file
+//          p: output filename
+//          t: output time data was read (since epoch)
+//          T: output time data was read (monotonic)
+//          d: output time since the previous line was output
+//          k: output kernel timestamp of a gpiochip edge
+//          n: output sequence number of a gpiochip edge
+//          c: output count of lines suppressed since the previous output
+//
+// write() adds a line's fields to an Output following the operations.
+//
+class Format {
+public:
+    struct Op {
+        char code;              // % code or '\0' for a literal
+        const char *literal;    // literal span (not nul terminated)
+        unsigned int length;    // literal length
+    };
+
+    //
+    // what a line can be formatted with
+    //
+    struct Fields {
+        const char *line;
+        size_t length;
+        const char *path;
+        size_t pathLength;
+        const Timestamp *read;          // time the line was read
+        long_time_t delta;              // since the previous line was output
+        long_time_t edgeTime;
+        unsigned int edgeSequence;
+        unsigned long suppressed;
+    };
+
+    Op ops[formatOpMax];
+    unsigned int opCount;
+
+private:
+    //
+    // add an operation, returns false if there are too many
+    //
+    bool add( const char code, const char *literal, const unsigned int length ) {
+        if( opCount >= formatOpMax ) {
+            return false;
+        }
+
+        ops[opCount].code = code;
+        ops[opCount].literal = literal;
+        ops[opCount].length = length;
+        ++opCount;
+        return true;
+    };
+
+
+
+    //
+    // add a literal span if it isn't empty
+    //
+    bool span( const char *start, const char *end ) {
+        return end <= start || add( '\0', start, end - start );
+    };
+
+
+
+public:
+    //
+    // constructors, an empty format outputs nothing until compiled
+    //
+    Format() {
+        opCount = 0;
+    };
+
+    Format( const char *format ) {
+        opCount = 0;
+        compile( format );
+    };
+
+
+
+    //
+    // compile a +FORMAT string (after backslash translation), which must
+    // outlive the format, returns false (after a message) if it is too long
+    //
+    bool compile( const char *format ) {
+        opCount = 0;
+
+        const char *start = format + 1;         // skip the +
+        const char *ptr;
+        bool fits = true;
+        for( ptr = start; *ptr && fits; ++ptr ) {
+            if( *ptr == '%' && ptr[1] == '%' ) {
+                // %%: literal up to and including the first %
+                fits = span( start, ptr + 1 );
+                start = ++ptr + 1;
+
+            } else if( *ptr == '%' && ptr[1] && strchr( formatChr, ptr[1] ) ) {
+                fits = span( start, ptr ) && add( ptr[1], NULL, 0 );
+                start = ++ptr + 1;
+            }
+        }
+
+        if( !fits || !span( start, ptr ) ) {
+            fprintf( stderr, "Format too long: %s\n", format );
+            return false;
+        }
+        return true;
+    };
+
+
+
+    //
+    // longest output this format can produce
+    //
+    size_t longest( const size_t lineLength, const size_t pathLength ) const {
+        size_t length = 0;
+        for( unsigned int op = 0; op < opCount; ++op ) {
+            switch( ops[op].code ) {
+            case '\0':
+                length += ops[op].length;
+                break;
+            case 'l':
+                length += lineLength;
+                break;
+            case 'p':
+                length += pathLength;
+                break;
+            default:
+                length += digitsMax;
+                break;
+            }
+        }
+        return length;
+    };
+
+
+
+    //
+    // add a line to the output
+    //
+    void write( Output &output, const Fields &fields ) const {
+        const Op *end = ops + opCount;
+        for( const Op *op = ops; op < end; ++op ) {
+            switch( op->code ) {
+            case 'l':
+                output.span( fields.line, fields.length );
+                break;
+            case 'p':
+                output.span( fields.path, fields.pathLength );
+                break;
+            case 't':
+                output.number( fields.read->epoch );
+                break;
+            case 'T':
+                output.number( fields.read->monotonic );
+                break;
+            case 'd':
+                output.number( fields.delta );
+                break;
+            case 'k':
+                output.number( fields.edgeTime );
+                break;
+            case 'n':
+                output.number( fields.edgeSequence );
+                break;
+            case 'c':
+                output.number( fields.suppressed );
+                break;
+            default:
+                output.span( op->literal, op->length );
+                break;
+            }
+        }
+    };
+};
+
+extern Format defaultFormat;
+
+
+
+class Delimiters;
+
+
+
+//
+// Decoder class
+//
+// Splits a file's input into records, instead of delimited lines, and
+// checks them; selected per file with --decode.  A record is normalized
+// in place, as it is never longer than its input, so it is output from
+// the ring like a line.  Corrupt records are dropped and counted.
+//
+// rfid125      STX, 10 data and 2 checksum hex digits, ETX as sent by
+//              125kHz RFID readers; CR and LF are ignored.  The checksum
+//              is the exclusive or of the data bytes.  Readers without
+//              STX and ETX send 10 or 12 digits on a line.  The record is
+//              the digits in the case the reader sent them.
+// fixed:N      Records of exactly N bytes
+// hex          Delimited lines of hex bytes, which may be separated by
+//              spaces or colons.  The record is the digits in upper case.
+//
+class Decoder {
+public:
+    enum Result {
+        record,                 // a record of length bytes at startPtr
+        split,                  // a line cut at lineMax, as a record
+        corrupt,                // dropped, carry on from nextPtr
+        more                    // needs more input from nextPtr
+    };
+
+    virtual ~Decoder() {};
+
+    //
+    // find the next record in [startPtr, endPtr)
+    //
+    virtual Result next( char *startPtr, char *endPtr, const Delimiters *delimiters, const size_t lineMax, size_t &length, char *&nextPtr ) = 0;
+
+    //
+    // most input a record needs, which must fit --max-line
+    //
+    virtual size_t longest() {
+        return 0;
+    };
+
+
+
+    //
+    // value of a hex digit or -1
+    //
+    static int hexValue( const char chr ) {
+        if( chr >= '0' && chr <= '9' ) {
+            return chr - '0';
+
+        } else if( chr >= 'A' && chr <= 'F' ) {
+            return chr - 'A' + 10;
+
+        } else if( chr >= 'a' && chr <= 'f' ) {
+            return chr - 'a' + 10;
+        }
+        return -1;
+    };
+
+
+
+    //
+    // make a decoder from its --decode name, NULL if unknown
+    //
+    static Decoder *create( const char *name );
+};
+
+
+
+//
+// Delimiters class
+//
+// A --delimiters set built once when the arguments are parsed.  Every
+// delimiter has a bit in a 256 bit table so checking a byte is one lookup
+// rather than a scan of the set.  Where SSE2 or NEON is available and the
+// set is small, sixteen bytes are compared against every delimiter at once.
+//
+// Searching is bounded by length, not a nul, so binary data with embedded
+// nuls is split correctly.
+//
+// split() is the delimiter stage, which splits a file's input into lines
+// unless it has a decoder.
+//
+class Delimiters {
+private:
+    uint32_t table[256 / 32];   // bit set for each delimiter byte
+    unsigned char set[delimiterVectorMax];
+    unsigned int setCount;      // delimiters in set or 0 to only use table
+
+    //
+    // test a byte against the table
+    //
+    bool match( const unsigned char chr ) const {
+        return table[chr >> 5] & (1u << (chr & 31));
+    };
+
+
+
+public:
+    //
+    // build from a delimiters string (after backslash translation)
+    //
+    Delimiters( const char *delimiters ) {
+        memset( table, 0, sizeof( table ) );
+        unsigned int count = 0;
+
+        for( const unsigned char *ptr = (const unsigned char *)delimiters; *ptr; ++ptr ) {
+            if( !match( *ptr ) ) {
+                table[*ptr >> 5] |= 1u << (*ptr & 31);
+                if( count < delimiterVectorMax ) {
+                    set[count] = *ptr;
+                }
+                ++count;
+            }
+        }
+
+        setCount = count <= delimiterVectorMax ? count : 0;
+    };
+
+
+
+    //
+    // find the first delimiter from ptr up to end, returns NULL if none
+    //
+    const char *find( const char *ptr, const char *end ) const {
+#if defined( __SSE2__ )
+        if( setCount ) {
+            while( end - ptr >= 16 ) {
+                const __m128i block = _mm_loadu_si128( (const __m128i *)ptr );
+                __m128i hits = _mm_setzero_si128();
+                for( unsigned int index = 0; index < setCount; ++index ) {
+                    hits = _mm_or_si128( hits, _mm_cmpeq_epi8( block, _mm_set1_epi8( set[index] ) ) );
+                }
+
+                const int mask = _mm_movemask_epi8( hits );
+                if( mask ) {
+                    return ptr + __builtin_ctz( mask );
+                }
+                ptr += 16;
+            }
+        }
+#elif defined( __ARM_NEON )
+        if( setCount ) {
+            while( end - ptr >= 16 ) {
+                const uint8x16_t block = vld1q_u8( (const uint8_t *)ptr );
+                uint8x16_t hits = vdupq_n_u8( 0 );
+                for( unsigned int index = 0; index < setCount; ++index ) {
+                    hits = vorrq_u8( hits, vceqq_u8( block, vdupq_n_u8( set[index] ) ) );
+                }
+
+                // narrow to four bits per byte to make a 64 bit mask
+                const uint64_t mask = vget_lane_u64( vreinterpret_u64_u8( vshrn_n_u16( vreinterpretq_u16_u8( hits ), 4 ) ), 0 );
+                if( mask ) {
+                    return ptr + (__builtin_ctzll( mask ) >> 2);
+                }
+                ptr += 16;
+            }
+        }
+#endif
+        for( ; ptr < end; ++ptr ) {
+            if( match( *ptr ) ) {
+                return ptr;
+            }
+        }
+        return NULL;
+    };
+
+
+
+    //
+    // the delimiter stage: find the next line in [startPtr, endPtr), a line
+    // longer than lineMax is cut at lineMax
+    //
+    Decoder::Result split( char *startPtr, char *endPtr, const size_t lineMax, size_t &length, char *&nextPtr ) const {
+        // no need to look further than the longest line
+        const char *eolPtr = find( startPtr, startPtr + std::min( (size_t)(endPtr - startPtr), lineMax + 1 ) );
+
+        if( eolPtr ) {
+            length = eolPtr - startPtr;
+            nextPtr = startPtr + length + 1;
+            return Decoder::record;
+
+        // split lines which are too long to keep
+        } else if( (size_t)(endPtr - startPtr) >= lineMax ) {
+            length = lineMax;
+            nextPtr = startPtr + length;
+            return Decoder::split;
+        }
+
+        nextPtr = startPtr;
+        return Decoder::more;
+    };
+};
+
+extern Delimiters defaultDelimiters;
+
+
+
+//
+// RfidDecoder class
+//
+class RfidDecoder : public Decoder {
+private:
+    //
+    // gather the hex digits in [in, end) to out, skipping line ends, and
+    // return how many there are or 0 if they aren't a tag: 12 digits
+    // whose exclusive or, including the checksum, is 0 or, on a bare line,
+    // just the 10 data digits
+    //
+    static size_t digits( const char *in, const char *end, char *out, const bool bare ) {
+        unsigned int count = 0;
+        unsigned int check = 0;
+        for( ; in < end; ++in ) {
+            if( *in == '\r' || *in == '\n' ) {
+                continue;
+            }
+
+            const int nibble = hexValue( *in );
+            if( nibble < 0 || count == rfidDigits ) {
+                return 0;
+            }
+
+            out[count] = *in;
+            check ^= count & 1 ? nibble : nibble << 4;
+            ++count;
+        }
+
+        if( count == rfidDigits ) {
+            return check ? 0 : count;
+        }
+        return bare && count == rfidDataDigits ? count : 0;
+    };
+
+
+
+public:
+    Result next( char *startPtr, char *endPtr, const Delimiters *, const size_t, size_t &length, char *&nextPtr ) {
+        // line ends between frames are ignored
+        char *ptr = startPtr;
+        while( ptr < endPtr && (*ptr == '\r' || *ptr == '\n') ) {
+            ++ptr;
+        }
+        if( ptr == endPtr ) {
+            nextPtr = ptr;
+            return more;
+        }
+
+        char *limit = ptr + std::min( (size_t)(endPtr - ptr), rfidFrameMax );
+
+        // outside a frame the digits may be on a bare line, anything else
+        // up to the next line end or frame is noise
+        if( *ptr != rfidStart ) {
+            char *eol = ptr;
+            while( eol < limit && *eol != '\r' && *eol != '\n' && *eol != rfidStart ) {
+                ++eol;
+            }
+            if( eol == endPtr && (size_t)(endPtr - ptr) < rfidFrameMax ) {
+                nextPtr = ptr;
+                return more;
+            }
+
+            nextPtr = eol;
+            length = digits( ptr, eol, startPtr, true );
+            return length ? record : corrupt;
+        }
+
+        char *etx = (char *)memchr( ptr, rfidEnd, limit - ptr );
+        if( !etx ) {
+            if( (size_t)(endPtr - ptr) < rfidFrameMax ) {
+                nextPtr = ptr;
+                return more;
+            }
+
+            // lost the end so look for the next start
+            nextPtr = ptr + 1;
+            return corrupt;
+        }
+        nextPtr = etx + 1;
+
+        length = digits( ptr + 1, etx, startPtr, false );
+        return length ? record : corrupt;
+    };
+
+    size_t longest() {
+        return rfidFrameMax;
+    };
+};
+
+
+
+//
+// FixedDecoder class
+//
+class FixedDecoder : public Decoder {
+private:
+    size_t size;
+
+public:
+    FixedDecoder( const size_t recordSize ) {
+        size = recordSize;
+    };
+
+    Result next( char *startPtr, char *endPtr, const Delimiters *, const size_t, size_t &length, char *&nextPtr ) {
+        if( (size_t)(endPtr - startPtr) < size ) {
+            nextPtr = startPtr;
+            return more;
+        }
+
+        length = size;
+        nextPtr = startPtr + size;
+        return record;
+    };
+
+    size_t longest() {
+        return size;
+    };
+};
+
+
+
+//
+// HexDecoder class
+//
+class HexDecoder : public Decoder {
+public:
+    Result next( char *startPtr, char *endPtr, const Delimiters *delimiters, const size_t lineMax, size_t &length, char *&nextPtr ) {
+        const char *eolPtr = delimiters->find( startPtr, std::min( endPtr, startPtr + lineMax + 1 ) );
+        if( !eolPtr ) {
+            if( (size_t)(endPtr - startPtr) < lineMax ) {
+                nextPtr = startPtr;
+                return more;
+            }
+
+            nextPtr = startPtr + lineMax;
+            return corrupt;
+        }
+        nextPtr = startPtr + (eolPtr - startPtr) + 1;
+
+        // keep the digits, dropping separators between bytes
+        char *out = startPtr;
+        for( const char *in = startPtr; in < eolPtr; ++in ) {
+            if( *in == ' ' || *in == '\t' || *in == ':' ) {
+                continue;
+            }
+
+            const int nibble = hexValue( *in );
+            if( nibble < 0 ) {
+                return corrupt;
+            }
+            *out++ = hexDigits[nibble];
+        }
+
+        length = out - startPtr;
+        return length & 1 ? corrupt : record;
+    };
+};
+
+
+
+//
+// Bounce class
+//
+// Measures the bounce of one file for --debounce auto and statistics.
+// An actuation is a run of lines with no gap longer than debounceAutoMax
+// and its envelope is the time from the first line to the last.  The
+// learned window is the shortest bucket bound covering 99% of envelopes.
+//
+class Bounce {
+public:
+    unsigned long actuations;   // Completed actuations
+    unsigned long edges;        // Lines in completed actuations
+    long_time_t envelopeMax;    // Longest envelope
+    unsigned long histogram[bounceBuckets];     // Envelopes by bucket
+
+private:
+    long_time_t first;          // Time of the first line of this actuation
+    long_time_t last;           // Time of the latest line
+    unsigned int burst;         // Lines in this actuation (0 before any)
+
+public:
+    void init() {
+        actuations = 0;
+        edges = 0;
+        envelopeMax = 0;
+        memset( histogram, 0, sizeof( histogram ) );
+        burst = 0;
+    };
+
+
+
+    //
+    // upper bound of a bucket
+    //
+    static long_time_t bound( const unsigned int bucket ) {
+        return bounceBucketBase << bucket;
+    };
+
+
+
+    //
+    // note a line read at time, returns true if it started a new actuation
+    // after completing one
+    //
+    bool line( const long_time_t time ) {
+        bool completed = false;
+
+        if( burst && time - last > debounceAutoMax ) {
+            const long_time_t envelope = last - first;
+            unsigned int bucket = 0;
+            while( bucket < bounceBuckets - 1 && envelope >= bound( bucket ) ) {
+                ++bucket;
+            }
+
+            ++histogram[bucket];
+            ++actuations;
+            edges += burst;
+            envelopeMax = std::max( envelopeMax, envelope );
+            burst = 0;
+            completed = true;
+        }
+
+        if( burst == 0 ) {
+            first = time;
+        }
+        last = time;
+        ++burst;
+        return completed;
+    };
+
+
+
+    //
+    // learned debounce window
+    //
+    long_time_t window() {
+        if( actuations == 0 ) {
+            return debounceAutoMax;
+        }
+
+        unsigned int bucket = 0;
+        unsigned long covered = histogram[0];
+        while( covered * 100 < actuations * 99 ) {
+            covered += histogram[++bucket];
+        }
+
+        return std::min( std::max( bound( bucket ), debounceAutoMin ), debounceAutoMax );
+    };
+};
+
+
+
+//
+// PFDOption class
+//
+// Poll file descriptor options associated with output
+//
+class PFDOption {
+public:
+    Format *format;             // Compiled format string
+    Delimiters *delimiters;     // Line end delimiters
+    Decoder *decoder;           // Splits and checks records instead of lines, or NULL
+    long_time_t debounce;       // Time to wait for value to settle
+    bool debounceAuto;          // Learn debounce from the bounces seen
+    bool duplicates;            // Allow duplicate values to be sent onwards
+    bool readStamp;             // Timestamp each read rather than each wakeup
+    unsigned int lineMax;       // Longest line before it is split
+    unsigned int quadrature;    // Edges per quadrature step or 0 to report the lines
+    bool reopen;                // Reopen the file if it is lost
+    long_time_t coalesce;       // Least time between lines output, the latest held wins
+    long_time_t rateInterval;   // Time per token of the --max-rate bucket or 0
+    long_time_t rateTolerance;  // Burst the bucket allows, as time
+
+    void init() {
+        format = &defaultFormat;
+        delimiters = &defaultDelimiters;
+        decoder = NULL;
+        debounce = 0;
+        debounceAuto = false;
+        duplicates = true;
+        readStamp = false;
+        lineMax = lineMaxDefault;
+        quadrature = 0;
+        reopen = false;
+        coalesce = 0;
+        rateInterval = 0;
+        rateTolerance = 0;
+    };
+};
+
+
+
+//
+// Debounce class
+//
+// The debounce stage: decides whether a file's line is output straight
+// away or held, and until when.  A line is held while the file is still
+// bouncing (read within --debounce of the previous read) or the gate is
+// shut: --coalesce after the last line output and the --max-rate token
+// bucket.  The bucket is kept as the time it will be full, so it needs no
+// refilling, and has a token if that is less than the burst away.
+//
+// The held line itself stays in the file's ring.
+//
+class Debounce {
+private:
+    long_time_t emitTime;       // lineTime of the last line output (for --coalesce)
+    long_time_t rateTime;       // When the --max-rate token bucket will be full again
+
+public:
+    void init() {
+        emitTime = 0;
+        rateTime = 0;
+    };
+
+
+
+    //
+    // the file has been quiet for the debounce time since it was read, or
+    // since its last gpiochip edge
+    //
+    static bool settled( const PFDOption &option, const long_time_t readTime, const long_time_t now ) {
+        return now >= readTime + option.debounce;
+    };
+
+
+
+    //
+    // earliest time a line may be output
+    //
+    long_time_t gate( const PFDOption &option ) const {
+        const long_time_t coalesced = emitTime + option.coalesce;
+        const long_time_t rated = rateTime > option.rateTolerance ? rateTime - option.rateTolerance : 0;
+        return std::max( coalesced, rated );
+    };
+
+
+
+    //
+    // a settled line ready at lineTime may be output now
+    //
+    bool open( const PFDOption &option, const long_time_t lineTime ) const {
+        return gate( option ) <= lineTime;
+    };
+
+
+
+    //
+    // when a line held after a read at readTime may be output
+    //
+    long_time_t deadline( const PFDOption &option, const long_time_t readTime ) const {
+        return std::max( readTime + option.debounce, gate( option ) );
+    };
+
+
+
+    //
+    // a line ready at lineTime has been output
+    //
+    void emitted( const PFDOption &option, const long_time_t lineTime ) {
+        emitTime = lineTime;
+        rateTime = std::max( rateTime, lineTime ) + option.rateInterval;
+    };
+};
+
+
+
+//
+// Backend class
+//
+// Waits for events on an EventLoop's poll file descriptors and returns
+// the list of indexes which are ready.
+//
+// poll:  poll(2) over the whole pfd[] array, then collect those with revents
+// epoll: each pfd is registered once with epoll(7), a wakeup only returns
+//        the descriptors which fired so the cost depends on active sources
+//        rather than the number of files being watched
+//
+// Descriptors holding debounced data are woken by the Timers class instead.
+//
+// Each --threads worker's loop has its own epoll backend for its share of
+// the files.
+//
+class Backend {
+private:
+    bool useEpoll;
+    int epollFd;
+    struct pollfd *pfd;         // the loop's pfd[pfdMax]
+    struct epoll_event *events; // events[pfdMax]
+
+    nfds_t *ready;              // indexes of descriptors to be checked, ready[pfdMax]
+    nfds_t readyCount;
+
+public:
+    //
+    // constructor
+    //
+    Backend() {
+        useEpoll = false;
+        epollFd = -1;
+        readyCount = 0;
+    };
+
+
+
+    //
+    // size of the tables needed for pfdMax files
+    //
+    static size_t tableSize( const nfds_t pfdMax ) {
+        return sizeof( nfds_t ) * pfdMax + sizeof( struct epoll_event ) * pfdMax;
+    };
+
+
+
+    //
+    // set the tables from a block of tableSize() bytes
+    //
+    void tables( char *block, struct pollfd *loopPfd, const nfds_t pfdMax ) {
+        pfd = loopPfd;
+        ready = (nfds_t *)block;
+        events = (struct epoll_event *)(ready + pfdMax);
+    };
+
+
+
+    //
+    // select the backend by name, returns false if it is unknown
+    //
+    bool select( const char *name ) {
+        if( strcmp( name, "epoll" ) == 0 ) {
+            useEpoll = true;
+
+        } else if( strcmp( name, "poll" ) == 0 ) {
+            useEpoll = false;
+
+        } else {
+            fprintf( stderr, "Unknown backend: %s\n", name );
+            return false;
+        }
+        return true;
+    };
+
+
+
+    //
+    // register the first pfdCount files with the backend, a worker thread
+    // only registers the files with index % shards == shard
+    // returns false on error
+    //
+    bool start( const nfds_t pfdCount, const nfds_t shard = 0, const nfds_t shards = 1 ) {
+        if( !useEpoll ) {
+            return true;
+        }
+
+        epollFd = epoll_create1( EPOLL_CLOEXEC );
+        if( epollFd < 0 ) {
+            perror( "epoll" );
+            return false;
+        }
+
+        for( nfds_t index = shard; index < pfdCount; index += shards ) {
+            if( !add( index ) ) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+
+
+    //
+    // start watching a file descriptor opened after start()
+    // poll finds it in pfd[] so only epoll needs to be told
+    //
+    bool add( const nfds_t index ) {
+        if( useEpoll && epollFd >= 0 && pfd[index].fd >= 0 ) {
+            struct epoll_event event;
+            event.events = pfd[index].events;   // POLLPRI/POLLIN have the same values as EPOLLPRI/EPOLLIN
+            event.data.u64 = index;
+
+            if( epoll_ctl( epollFd, EPOLL_CTL_ADD, pfd[index].fd, &event ) < 0 ) {
+                perror( "epoll_ctl" );
+                return false;
+            }
+        }
+        return true;
+    };
+
+
+
+    //
+    // stop watching a file descriptor
+    //
+    void remove( const nfds_t index ) {
+        if( useEpoll && pfd[index].fd >= 0 ) {
+            epoll_ctl( epollFd, EPOLL_CTL_DEL, pfd[index].fd, NULL );
+        }
+        pfd[index].fd = -1;     // poll ignores negative file descriptors
+    };
+
+
+
+    //
+    // wait for events on the first pfdCount files or the timeout
+    // (nanoseconds) and build the ready list, returns false on error
+    // timeout is rounded up so we don't wake just before a deadline
+    //
+    bool wait( const long_time_t timeout, const nfds_t pfdCount ) {
+        const int msTimeout = timeout == FOREVER ? -1 : (timeout + MILLISECOND - 1) / MILLISECOND;
+        readyCount = 0;
+
+        if( useEpoll ) {
+            const int eventCount = epoll_wait( epollFd, events, pfdCount, msTimeout );
+            if( eventCount < 0 && errno == EINTR ) {
+                return true;
+
+            } else if( eventCount < 0 ) {
+                perror( "epoll_wait" );
+                return false;
+            }
+
+            for( int eventIndex = 0; eventIndex < eventCount; ++eventIndex ) {
+                const nfds_t index = events[eventIndex].data.u64;
+                pfd[index].revents = events[eventIndex].events;
+                ready[readyCount++] = index;
+            }
+
+        } else {
+            if( poll( pfd, pfdCount, msTimeout ) < 0 ) {
+                if( errno == EINTR ) {
+                    return true;
+                }
+                perror( "poll" );
+                return false;
+            }
+
+            for( nfds_t index = 0; index < pfdCount; ++index ) {
+                if( pfd[index].revents ) {
+                    ready[readyCount++] = index;
+                }
+            }
+        }
+        return true;
+    };
+
+
+
+    //
+    // access the ready list
+    //
+    nfds_t count() {
+        return readyCount;
+    };
+
+    nfds_t index( const nfds_t readyIndex ) {
+        return ready[readyIndex];
+    };
+};
+
+
+
+//
+// Timers class
+//
+// A min-heap of deadlines keyed by descriptor index.  Only
+// descriptors holding debounced data are in the heap so the next timeout
+// is read from the top and expired debounces are found without visiting
+// idle descriptors.  Each EventLoop, so each --threads worker, has its own
+// heap.
+//
+// heap[0..heapCount)           descriptor indexes, earliest deadline first
+// position[pfdIndex]           where the descriptor is in heap or NOWHERE
+// deadline[pfdIndex]           when the descriptor needs checking
+//
+class Timers {
+private:
+    static const nfds_t NOWHERE = -1;
+
+    long_time_t *deadline;      // deadline[pfdMax]
+    nfds_t *heap;               // heap[pfdMax]
+    nfds_t *position;           // position[pfdMax]
+    nfds_t heapCount;
+
+    //
+    // swap two heap entries keeping positions up to date
+    //
+    void swap( const nfds_t a, const nfds_t b ) {
+        std::swap( heap[a], heap[b] );
+        position[heap[a]] = a;
+        position[heap[b]] = b;
+    };
+
+
+
+    //
+    // move an entry towards the top until its parent is earlier
+    //
+    void up( nfds_t pos ) {
+        while( pos > 0 ) {
+            const nfds_t parent = (pos - 1) / 2;
+            if( deadline[heap[parent]] <= deadline[heap[pos]] ) {
+                break;
+            }
+            swap( parent, pos );
+            pos = parent;
+        }
+    };
+
+
+
+    //
+    // move an entry towards the bottom until its children are later
+    //
+    void down( nfds_t pos ) {
+        while( true ) {
+            nfds_t earliest = pos;
+            const nfds_t left = 2 * pos + 1;
+            const nfds_t right = left + 1;
+
+            if( left < heapCount && deadline[heap[left]] < deadline[heap[earliest]] ) {
+                earliest = left;
+            }
+            if( right < heapCount && deadline[heap[right]] < deadline[heap[earliest]] ) {
+                earliest = right;
+            }
+            if( earliest == pos ) {
+                break;
+            }
+            swap( earliest, pos );
+            pos = earliest;
+        }
+    };
+
+
+
+public:
+    //
+    // constructor
+    //
+    Timers() {
+        heapCount = 0;
+    };
+
+
+
+    //
+    // size of the tables needed for pfdMax files
+    //
+    static size_t tableSize( const nfds_t pfdMax ) {
+        return sizeof( long_time_t ) * pfdMax + 2 * sizeof( nfds_t ) * pfdMax;
+    };
+
+
+
+    //
+    // set the tables from a block of tableSize() bytes
+    //
+    void tables( char *block, const nfds_t pfdMax ) {
+        deadline = (long_time_t *)block;
+        heap = (nfds_t *)(deadline + pfdMax);
+        position = heap + pfdMax;
+
+        for( nfds_t index = 0; index < pfdMax; ++index ) {
+            position[index] = NOWHERE;
+        }
+    };
+
+
+
+    //
+    // add or move a descriptor's deadline
+    //
+    void schedule( const nfds_t index, const long_time_t time ) {
+        if( position[index] == NOWHERE ) {
+            position[index] = heapCount;
+            heap[heapCount++] = index;
+            deadline[index] = time;
+            up( position[index] );
+
+        } else if( time < deadline[index] ) {
+            deadline[index] = time;
+            up( position[index] );
+
+        } else {
+            deadline[index] = time;
+            down( position[index] );
+        }
+    };
+
+
+
+    //
+    // remove a descriptor's deadline
+    //
+    void cancel( const nfds_t index ) {
+        const nfds_t pos = position[index];
+        if( pos == NOWHERE ) {
+            return;
+        }
+
+        swap( pos, --heapCount );
+        position[index] = NOWHERE;
+
+        if( pos < heapCount ) {
+            up( pos );
+            down( pos );
+        }
+    };
+
+
+
+    //
+    // earliest deadline or FOREVER
+    //
+    long_time_t next() {
+        return heapCount ? deadline[heap[0]] : FOREVER;
+    };
+
+
+
+    //
+    // descriptor with the earliest deadline
+    //
+    nfds_t first() {
+        return heap[0];
+    };
+};
+
+
+
+//
+// Recorder class
+//
+// Writes the --record log: every read from a file, as it
+// came, stamped with the time it was read, so --replay can feed the same
+// reads through the same debounce, decoding and formatting later.  See
+// frameRead for the format.  Worker threads' loops share their main
+// loop's log so each frame is written under the stream's lock.
+//
+class Recorder {
+private:
+    FILE *file;
+
+public:
+    Recorder() {
+        file = NULL;
+    };
+
+
+
+    //
+    // start a log, returns false on error
+    //
+    bool open( const char *name ) {
+        if( !(file = fopen( name, "w" )) ) {
+            perror( name );
+            return false;
+        }
+        setvbuf( file, NULL, _IOFBF, recordBuffer );
+        return true;
+    };
+
+
+
+    //
+    // add a frame to the log
+    //
+    void write( const uint16_t type, const uint16_t source, const long_time_t time, const void *payload, const uint32_t length ) {
+        uint8_t header[frameHeaderSize];
+        encodeFrame( header, type, source, time, length );
+
+        flockfile( file );
+        fwrite_unlocked( header, frameHeaderSize, 1, file );
+        fwrite_unlocked( payload, length, 1, file );
+        funlockfile( file );
+    };
+
+    void write( const uint16_t type, const uint16_t source, const long_time_t time, const uint64_t value ) {
+        uint8_t payload[8];
+        encodeLittle( payload, value, 8 );
+        write( type, source, time, payload, 8 );
+    };
+
+
+
+    //
+    // write what has been logged, at the end of a wakeup, returns false on
+    // error
+    //
+    bool flush() {
+        if( fflush( file ) < 0 ) {
+            perror( "record" );
+            return false;
+        }
+        return true;
+    };
+};
+
+
+
+class Source;
+class EventLoop;
+
+
+
+//
+// Listener class
+//
+// Runs the lines read from a loop's control source (see EventLoop::control)
+//
+class Listener {
+public:
+    virtual ~Listener() {};
+
+    virtual void command( EventLoop &loop, const char *line, const size_t length ) = 0;
+};
+
+
+
+//
+// EventLoop class
+//
+// The input engine: a table of sources, waited on together by a backend,
+// with a timer heap for the lines they hold and an Output for the lines
+// they print.  Nothing is global, so a program can embed a loop, with a
+// Sink in place of stdout, or run several.  Errors are returned: a method
+// returning false (or pfdMax for an index) has already said why on
+// stderr.
+//
+// EventLoop loop;
+// PFDOption option;
+// option.init();
+// if( !loop.init( 1 ) || loop.add( path, option ) == loop.pfdMax || !loop.listen() ) ...
+// Timestamp now;
+// now.read();
+// loop.start( now );
+// while( loop.run( now ) ) ...
+//
+// Poll file descriptors are provided by poll.h
+// They have to be in their own array for poll rather than in Source.
+//
+// nfds_t                       // pfdIndex type
+// pfd[pfdIndex].fd             // File descriptor
+// pfd[pfdIndex].events         // Events we're interested in
+// pfd[pfdIndex].revents        // Events that happened
+//
+// A --threads worker's loop shares its main loop's tables and checks a
+// share of its sources (see share()).
+//
+class EventLoop {
+public:
+    nfds_t pfdMax;              // Size of the per file tables
+    nfds_t pfdCount;            // Slots used, open or not
+    struct pollfd *pfd;         // structure used by poll.h, pfd[pfdMax]
+    Source *source;             // source[pfdMax]
+    char *rings;                // a ring buffer for each slot, rings[pfdMax * ringStride]
+    size_t ringStride;
+
+    Backend backend;
+    Timers timers;
+    Output output;
+    Recorder *recorder;         // --record log or NULL
+    Listener *listener;         // runs control commands or NULL
+    bool replaying;             // Reads come from a --replay log, on its clock, instead of the files
+    bool error;                 // A source can't carry on (a read failed)
+
+    // inotify descriptor watching the directories of --reopen files, so
+    // they can be reopened as soon as something appears rather than at
+    // the next backoff.  -1 if not watching.
+    int inotifyFd;
+
+    // Edge events from a gpiochip line request.  Only one file is read at
+    // a time, by each loop, so they can share one buffer.
+    struct gpio_v2_line_event gpioEvent[gpioEventMax];
+
+    //
+    // constructor
+    //
+    EventLoop() {
+        pfdMax = 0;
+        pfdCount = 0;
+        pfd = NULL;
+        source = NULL;
+        rings = NULL;
+        ringStride = 0;
+        recorder = NULL;
+        listener = NULL;
+        replaying = false;
+        error = false;
+        inotifyFd = -1;
+    };
+
+
+
+    //
+    // watch the directories of --reopen files, returns false on error
+    //
+    bool watch() {
+        inotifyFd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+        if( inotifyFd < 0 ) {
+            perror( "inotify" );
+            return false;
+        }
+        return true;
+    };
+
+
+
+    //
+    // start a --record log, returns false on error
+    //
+    bool record( const char *name ) {
+        recorder = new Recorder;
+        return recorder->open( name );
+    };
+
+
+
+    //
+    // take reads from a --replay log, before any file is opened
+    //
+    void replay() {
+        replaying = true;
+        output.setReplay( true );
+    };
+
+
+
+    //
+    // register the sources with the backend (replayed sources have no
+    // descriptors), returns false on error
+    //
+    bool listen() {
+        return replaying || backend.start( pfdCount );
+    };
+
+
+
+    //
+    // the loop has failed: a write or read error, which has been reported
+    //
+    bool failed() {
+        return error || output.failed();
+    };
+
+
+
+    bool init( const nfds_t max, const unsigned int lineMax = lineMaxDefault );
+    bool share( EventLoop &main, const nfds_t shard, const nfds_t shards );
+    nfds_t freeSlot( const char *pathname );
+    nfds_t add( char *pathname, const PFDOption &option );
+    nfds_t find( const char *pathname );
+    bool attach( const nfds_t pfdIndex, const Timestamp &now );
+    void remove( const nfds_t pfdIndex );
+    bool control( char *pathname, Listener *commands );
+    void watcher();
+    void start( const Timestamp &now );
+    bool check( Timestamp &now );
+    bool run( Timestamp &now, const long_time_t until = FOREVER );
+    void reopenNow( const Timestamp &now );
+    void command( const char *line, const size_t length );
+};
+
+
+
+//
+// Source class
+//
+// A file descriptor in an EventLoop and all its associated options: a
+// file, named pipe, character device, /sys value file or gpiochip lines,
+// the kind found from its pathname when it is opened.  Its input is read
+// into a ring, split into lines by its delimiters or decoder, held by its
+// debounce stage and formatted to the loop's output.
+//
+// EventLoop::source[pfdMax]
+//
+class Source {
+private:
+    EventLoop *loop;            // Loop the source is checked by
+    nfds_t index;               // Copy of the array index
+
+    char *pathname;
+    size_t pathLength;
+
+    struct stat status;         // Status of the pathname
+    int openMode;               // Pipes are opened read/write to keep them from being closed
+    short pollEvents;           // Special files use priority polling
+    bool reseek;                // Special files must seek to 0 before read
+    bool gpio;                  // gpiochipN:LINE[,LINE...] read through the GPIO character device
+    bool control;               // --control fifo, lines are commands
+    bool watcher;               // inotify descriptor, wakes lost files
+    bool reopening;             // lost and waiting to be reopened (--reopen)
+    bool failed;                // read failed
+    long_time_t backoff;        // time to the next reopen attempt
+    uint32_t *lineOffset;       // gpiochip line offsets, bit n of lineBits is lineOffset[n]
+    unsigned int lineCount;
+    uint64_t lineBits;          // gpiochip line values
+    uint32_t slotsUsed;         // gpiochip ring slots which output may still point at
+    int quadratureCount;        // edges counted towards the next quadrature step
+
+    Timestamp readTime;         // Time data last read from device
+    long_time_t printTime;      // Monotonic time of the last line printed (for %d)
+    unsigned long suppressed;   // Held lines replaced since the last line printed (for %c)
+    long_time_t edgeTime;       // Kernel timestamp of the gpiochip edge (for %k)
+    long_time_t settleTime;     // Monotonic time of the last read, or gpiochip edge, debounce runs from it
+    unsigned int edgeSequence;  // Sequence number of the gpiochip edge (for %n)
+
+    PFDOption option;           // Output options
+    Debounce debounce;          // Holds lines while bouncing or gated
+    Bounce bounce;              // Bounce measurements
+
+    struct {
+        unsigned long reads;        // reads returning data
+        unsigned long bytes;        // bytes read
+        unsigned long lines;        // lines (or gpiochip edges) read
+        unsigned long emitted;      // lines output
+        unsigned long duplicates;   // lines dropped by --unique
+        unsigned long holds;        // lines held by debounce
+        unsigned long coalesced;    // held lines replaced before being output
+        unsigned long splits;       // lines split at --max-line
+        unsigned long corrupt;      // records dropped by --decode
+    } counter;
+    long_time_t lineTime;       // Time the line being printed was ready (for latency)
+
+    //
+    // Ring buffer
+    //
+    // Data is read into ring[readEnd] onwards and lines are split in place.
+    // The unfinished line at ring[lineStart] stays where it is and the next
+    // read carries on after it.  Only when there isn't room for it to grow to
+    // lineMax before the end of the ring is it moved to the start (once a lap).
+    //
+    // The last printed and held lines are used where they are.  When the
+    // ring wraps, any still in the ring are copied to one of two pin slots
+    // after the ring so they aren't overwritten.
+    //
+    // storage: ring[ringSize] | pin[0][lineMax] | pin[1][lineMax]
+    //
+    char *ring;
+    size_t ringSize;
+    bool ringOwned;     // malloced as it's bigger than the loop's slot
+    size_t lineStart;   // start of the unfinished line
+    size_t readEnd;     // end of the data read
+    char *pin[2];
+
+    char *printPtr;     // last printed data
+    char *heldPtr;      // held data from debounce
+    size_t printLength;
+    size_t heldLength;
+
+    const char *replayPtr;      // a --replay read still to be taken
+    size_t replayLength;
+
+
+
+public:
+    //
+    // bytes of ring storage for lines of lineMax
+    //
+    static size_t ringBytes( const size_t lineMax, const bool gpio = false ) {
+        return (gpio ? gpioSlots * digitsMax : ringLines * lineMax) + 2 * lineMax;
+    };
+
+
+
+    //
+    // report an error, except while retrying a reopen
+    //
+    void reportpfd( const char *what ) {
+        if( !reopening ) {
+            perror( what );
+        }
+    };
+
+
+
+    bool statpfd();
+    int requestgpio();
+    bool linespfd( struct gpio_v2_line_request &request );
+    bool devicepfd();
+    void watchpfd();
+    bool openpfd( EventLoop *eventLoop, const nfds_t pfdi, char *fname, const PFDOption *argOption );
+    void closepfd();
+    void openwatcher( EventLoop *eventLoop, const nfds_t pfdi );
+    void lostpfd( const Timestamp &now );
+    void reopenpfd( const Timestamp &now );
+
+
+
+    //
+    // try to reopen now if lost (something appeared in a watched directory)
+    //
+    void wakepfd( const Timestamp &now ) {
+        if( pathname && reopening ) {
+            loop->timers.schedule( index, now.monotonic );
+        }
+    };
+
+
+
+    bool retunepfd( const PFDOption &newOption );
+    void startpfd( const Timestamp &now );
+
+
+
+    //
+    // read control commands instead of lines
+    //
+    void setControl() {
+        control = true;
+    };
+
+
+
+    //
+    // be checked by another loop sharing the tables, a --threads worker's
+    //
+    void setLoop( EventLoop *eventLoop ) {
+        loop = eventLoop;
+    };
+
+
+
+    //
+    // access for control commands and statistics
+    //
+    bool isOpen() {
+        return pathname != NULL;
+    };
+
+    bool isNamed( const char *name ) {
+        return pathname && strcmp( pathname, name ) == 0;
+    };
+
+    bool isNamed( const char *name, const size_t length ) {
+        return pathname && pathLength == length && memcmp( pathname, name, length ) == 0;
+    };
+
+    bool isInternal() {
+        return control || watcher;
+    };
+
+    const PFDOption &getOption() {
+        return option;
+    };
+
+
+
+    void checkpfd( const Timestamp &now );
+    Decoder::Result splitpfd( char *startPtr, char *endPtr, size_t &length, char *&nextPtr );
+    void stamppfd( const Timestamp &now );
+
+
+
+    //
+    // measure bounce and, with --debounce auto, update the window each time
+    // an actuation completes
+    //
+    void bouncepfd( const long_time_t time ) {
+        if( bounce.line( time ) && option.debounceAuto ) {
+            option.debounce = bounce.window();
+        }
+    };
+
+
+
+    void statspfd( FILE *stream );
+    void linepfd( char *startPtr, const size_t length, const bool nobounce );
+    void edgepfd( const Timestamp &now );
+    void bitspfd( const bool nobounce );
+    bool freepfd( const unsigned int index ) const;
+
+
+
+    //
+    // quadrature state of the first (A) and second (B) lines as AB
+    //
+    static unsigned int quadratureState( const uint64_t bits ) {
+        return (bits & 1) << 1 | (bits >> 1 & 1);
+    };
+
+
+
+    void steppfd( const uint64_t previous, const bool nobounce );
+    void valuepfd( const Timestamp &now );
+    void setbitspfd( const Timestamp &now, const uint64_t bits );
+    void pinpfd( char *&ptr, const size_t length, const char *otherPtr );
+    void wrappfd();
+    ssize_t inputpfd( void *buffer, const size_t size, const Timestamp &now );
+    void replaypfd( const Timestamp &now, const char *data, const size_t length );
+    unsigned int readpfd( const Timestamp &now );
+
+
+
+    //
+    // announce the file's index and pathname (binary mode)
+    //
+    void announcepfd() {
+        loop->output.start();
+        loop->output.frame( frameSource, index, 0, pathname, pathLength );
+        loop->output.end();
+    };
+
+
+
+    void printpfd( char *startPtr, const size_t length );
+    void formatpfd( char *startPtr, const size_t length );
+};
+
+
+
+//
+// Stats class
+//
+// Writes a loop's statistics: a stats line, a line per file and the
+// latency and wakeup histograms, ended by a blank line.  Written to stderr
+// on SIGUSR1 and every interval to a --stats file or fifo.
+//
+// With --threads the statistics are written by the main thread, for the
+// main loop: latency is measured to its writes and wakeup is its merging.
+// The per file counters are read without locking so may be a line behind.
+//
+class Stats {
+private:
+    int fd;                     // --stats file
+    FILE *file;                 // formats a record for fd
+    char *record;               // the record formatted
+    size_t recordLength;
+    size_t recordWritten;       // bytes of the record already written to fd
+    long_time_t interval;
+
+public:
+    Histogram wakeup;           // Time from waking to finishing the loop
+    long_time_t next;           // Monotonic time of the next periodic write
+
+    Stats() {
+        fd = -1;
+        file = NULL;
+        record = NULL;
+        recordLength = 0;
+        recordWritten = 0;
+        interval = statsIntervalDefault;
+        next = FOREVER;
+    };
+
+
+
+    bool setFile( const char *name );
+
+    void setInterval( const long_time_t time ) {
+        interval = time;
+    };
+
+
+
+    //
+    // set the first periodic write
+    //
+    void start( const long_time_t now ) {
+        if( file ) {
+            next = now + interval;
+        }
+    };
+
+
+
+    void check( EventLoop &loop, const long_time_t now );
+    void send();
+    void write( EventLoop &loop, FILE *stream );
+
+
+
+    //
+    // time a wakeup, from now until it is handled
+    //
+    void woken( const Timestamp &now ) {
+        struct timespec done;
+        clock_gettime( CLOCK_MONOTONIC_RAW, &done );
+        wakeup.record( Timestamp::nanoseconds( done ) - now.monotonic );
+    };
+};
+
+
+
+//
+// Workers class
+//
+// Shards a loop's files between --threads worker threads for many high
+// rate sources.  Each worker has its own loop, sharing the main loop's
+// files, which waits on its own epoll set, with its own timers and output
+// buffers, for the files whose index modulo the number of workers is its
+// own.  Workers queue every line they print, with its read time, and the
+// main thread merges them into time order and writes them in batches
+// through the main loop's output.
+//
+// Each line is held for the reorder window so a line read earlier by a
+// busier worker can still go before it.  A file's lines are all read by
+// one worker, in order, so keep their order.  A line arriving after a
+// later line has been written is written straight away.
+//
+class Workers {
+private:
+    struct Entry {              // a line waiting to be merged
+        long_time_t time;
+        uint64_t sequence;      // arrival order, breaks ties in time
+        uint32_t length;
+        char data[queueRecordMax];
+    };
+
+    unsigned int count;         // worker threads, 0 without --threads
+    long_time_t window;         // reorder window
+    Queue queue;
+    EventLoop *main;            // loop whose files are shared
+    EventLoop *loops;           // each worker's loop, loops[count]
+
+    Entry **heap;               // waiting lines, earliest first, heap[queueSlots]
+    unsigned int heapCount;
+    Entry **free;               // unused entries, free[queueSlots]
+    unsigned int freeCount;
+    Entry **written;            // entries gathered for the next flush, written[queueSlots]
+    unsigned int writtenCount;
+    uint64_t arrivals;
+    uint32_t seen;              // queue sequence before it was last emptied
+    unsigned int started;       // workers which have taken a shard
+    bool error;                 // a worker's loop has failed
+
+    //
+    // heap order, std::push_heap puts the latest last
+    //
+    static bool later( const Entry *a, const Entry *b ) {
+        return a->time != b->time ? a->time > b->time : a->sequence > b->sequence;
+    };
+
+
+
+    //
+    // a worker thread, each takes the next shard number
+    //
+    static void *work( void *arg ) {
+        Workers *self = (Workers *)arg;
+        return self->run( __atomic_fetch_add( &self->started, 1, __ATOMIC_RELAXED ) );
+    };
+
+    void *run( const unsigned int shard );
+    void pop();
+    void flush();
+    void abandon( pthread_t *threads, const unsigned int running, Entry *pool );
+
+
+
+public:
+    //
+    // constructor
+    //
+    Workers() {
+        count = 0;
+        window = reorderDefault;
+        main = NULL;
+        loops = NULL;
+        heapCount = 0;
+        freeCount = 0;
+        writtenCount = 0;
+        arrivals = 0;
+        seen = 0;
+        started = 0;
+        error = false;
+    };
+
+
+
+    //
+    // number of worker threads
+    //
+    void setCount( const unsigned int threads ) {
+        count = threads > 1 ? threads : 0;
+    };
+
+    bool active() {
+        return count > 0;
+    };
+
+
+
+    //
+    // time a line waits to be merged
+    //
+    void setWindow( const long_time_t time ) {
+        window = time;
+    };
+
+
+
+    bool start( EventLoop &loop );
+    bool run( Timestamp &now, const long_time_t until = FOREVER );
+};
+
+
+
+//
+// Replay class
+//
+// Feeds a --record log back through a loop's files, matched by pathname,
+// in place of their devices.  Time comes from the log: each read is
+// handled at the time it was recorded and debounce timers expire between
+// reads at their deadlines, so output is the same as when it was
+// recorded, whatever the speed.  With a speed the log is paced against
+// the real clock, otherwise it runs as fast as it can.
+//
+// Replay replay;
+// if( !replay.open( log ) ) ...
+// loop.replay();
+// ... open the files and start the loop
+// if( !replay.start( loop, now ) ) ...
+// while( replay.step( loop, now ) ) ...
+//
+class Replay {
+private:
+    FILE *file;
+    double speed;               // 0 for as fast as possible
+    nfds_t *source;             // file index of each recorded source or pfdMax
+
+    char *payload;
+    size_t payloadSize;
+
+    long_time_t clockMonotonic; // log time and epoch time of the frameClock
+    long_time_t clockEpoch;
+
+    bool started;               // pacing has started
+    long_time_t startTime;      // log time when pacing started
+    struct timespec startReal;  // and the real time
+
+    bool next( uint16_t &type, uint16_t &index, long_time_t &time, uint32_t &length );
+    void pace( const long_time_t time );
+    void at( Timestamp &now, const long_time_t time );
+    void expire( EventLoop &loop, Timestamp &now, const long_time_t time );
+
+
+
+public:
+    //
+    // constructor
+    //
+    Replay() {
+        file = NULL;
+        speed = 1;
+        source = NULL;
+        payload = NULL;
+        payloadSize = 0;
+        clockMonotonic = 0;
+        clockEpoch = 0;
+        started = false;
+    };
+
+
+
+    bool open( const char *name );
+
+    bool active() {
+        return file != NULL;
+    };
+
+
+
+    //
+    // log time passes at speed times real time, 0 for as fast as possible
+    //
+    void setSpeed( const double times ) {
+        speed = times;
+    };
+
+
+
+    bool start( EventLoop &loop, Timestamp &now );
+    bool step( EventLoop &loop, Timestamp &now );
+};
+
+#endif
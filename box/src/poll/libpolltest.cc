@@ -0,0 +1,449 @@
+//
+// Copyright 2013,2014,2015 Tarim
+//
+// Poll is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Poll is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with Poll.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Libpolltest uses libpoll the way an embedding program would, without
+// poll's command line: the delimiter, decoder, debounce and format stages
+// and the timer heap on their own, then an EventLoop reading a named pipe into a Sink.  Each failed check is
+// reported on stderr and the exit status is the number of failures.
+//
+// Usage: libpolltest
+//
+
+
+
+#include "libpoll.h"
+
+
+
+// Longest output collected by a test
+const size_t collectMax = 4096;
+
+// Time the loop test waits for its lines
+const long_time_t loopTimeout = 2000 * MILLISECOND;
+
+// Descriptors given deadlines by the timer test
+const nfds_t timerFiles = 200;
+
+int failures = 0;
+
+
+
+//
+// A decoder test: input split into two reads after cut bytes (0 for one
+// read) and the records expected, each followed by ';', with '!' for
+// each corrupt one dropped
+//
+struct DecodeCase {
+    const char *what;
+    const char *decode;
+    const char *input;
+    size_t cut;
+    const char *expect;
+};
+
+// an RFID tag, its checksum is the exclusive or of the five data bytes
+#define TAG "0415AB4C2E"
+#define SUM "D8"
+
+const DecodeCase decodeCases[] = {
+    { "rfid frame", "rfid125", "\002" TAG SUM "\003", 0, TAG SUM ";" },
+    { "rfid bad checksum", "rfid125", "\002" TAG "D9\003", 0, "!" },
+    { "rfid frame too short", "rfid125", "\002" TAG "\003", 0, "!" },
+    { "rfid frame too long", "rfid125", "\002" TAG SUM "00\003", 0, "!" },
+    { "rfid not hex", "rfid125", "\002" "0415AB4C2G" SUM "\003", 0, "!" },
+    { "rfid keeps case", "rfid125", "\002" "0415ab4c2e" "d8" "\003", 0, "0415ab4c2ed8;" },
+    { "rfid line ends ignored", "rfid125", "\r\n\002" TAG SUM "\r\n\003\r\n", 0, TAG SUM ";" },
+    { "rfid bare line", "rfid125", TAG SUM "\r\n", 0, TAG SUM ";" },
+    { "rfid bare data digits", "rfid125", TAG "\n", 0, TAG ";" },
+    { "rfid bare noise", "rfid125", "hello\n", 0, "!" },
+    { "rfid frame after noise", "rfid125", "xx\002" TAG SUM "\003", 0, "!" TAG SUM ";" },
+    { "rfid lost end", "rfid125", "\002" TAG SUM TAG "\002" TAG SUM "\003", 0, "!!!" TAG SUM ";" },
+    { "rfid frame split", "rfid125", "\002" TAG SUM "\003\002" TAG SUM "\003", 20, TAG SUM ";" TAG SUM ";" },
+    { "fixed records", "fixed:4", "abcdefgh", 0, "abcd;efgh;" },
+    { "fixed record split", "fixed:4", "abcdefgh", 3, "abcd;efgh;" },
+    { "fixed partial record", "fixed:4", "abcdef", 0, "abcd;" },
+    { "hex separators", "hex", "0a:1B 2c\td4\n", 0, "0A1B2CD4;" },
+    { "hex odd digits", "hex", "abc\n12\n", 0, "!12;" },
+    { "hex not hex", "hex", "0g\n", 0, "!" },
+    { "hex line split", "hex", "0102\n0304\n", 7, "0102;0304;" },
+};
+
+
+
+//
+// note a check which failed
+//
+void check( const bool ok, const char *what ) {
+    if( !ok ) {
+        fprintf( stderr, "FAIL: %s\n", what );
+        ++failures;
+    }
+};
+
+
+
+//
+// Collect class
+//
+// A Sink keeping what an Output writes
+//
+class Collect : public Sink {
+public:
+    char text[collectMax];
+    size_t length;
+
+    Collect() {
+        length = 0;
+    };
+
+    void write( const struct iovec *vec, const int count, const long_time_t ) {
+        for( int index = 0; index < count; ++index ) {
+            const size_t take = std::min( vec[index].iov_len, collectMax - length );
+            memcpy( text + length, vec[index].iov_base, take );
+            length += take;
+        }
+    };
+
+    bool is( const char *expect ) {
+        return length == strlen( expect ) && memcmp( text, expect, length ) == 0;
+    };
+};
+
+
+
+//
+// the delimiter stage: lines, an empty line between two delimiters, an
+// unfinished line and one cut at lineMax
+//
+void testDelimiters() {
+    Delimiters delimiters( "\r\n" );
+    char input[] = "one\r\ntwo\nthree";
+    char *ptr = input;
+    char *end = input + strlen( input );
+    size_t length;
+    char *next;
+
+    check( delimiters.split( ptr, end, 64, length, next ) == Decoder::record && length == 3 && memcmp( ptr, "one", 3 ) == 0, "split a line" );
+    ptr = next;
+    check( delimiters.split( ptr, end, 64, length, next ) == Decoder::record && length == 0, "split an empty line" );
+    ptr = next;
+    check( delimiters.split( ptr, end, 64, length, next ) == Decoder::record && length == 3 && memcmp( ptr, "two", 3 ) == 0, "split a line after an empty one" );
+    ptr = next;
+    check( delimiters.split( ptr, end, 64, length, next ) == Decoder::more && next == ptr, "wait for the rest of a line" );
+    check( delimiters.split( ptr, end, 3, length, next ) == Decoder::split && length == 3 && next == ptr + 3, "cut a long line at lineMax" );
+};
+
+
+
+//
+// the decoder stage: each case's records, fed through a decoder the way a
+// source's reads are
+//
+void testDecoders() {
+    for( size_t test = 0; test < sizeof( decodeCases ) / sizeof( decodeCases[0] ); ++test ) {
+        const DecodeCase &decodeCase = decodeCases[test];
+        Decoder *decoder = Decoder::create( decodeCase.decode );
+        if( !decoder ) {
+            check( false, decodeCase.what );
+            continue;
+        }
+
+        char input[collectMax];
+        const size_t total = strlen( decodeCase.input );
+        memcpy( input, decodeCase.input, total );
+        size_t available = decodeCase.cut ? decodeCase.cut : total;
+
+        char output[collectMax];
+        size_t outputLength = 0;
+        char *ptr = input;
+        while( true ) {
+            size_t length;
+            char *next;
+            const Decoder::Result result = decoder->next( ptr, input + available, &defaultDelimiters, 64, length, next );
+
+            // the next read, or the end of the input
+            if( result == Decoder::more ) {
+                if( available == total ) {
+                    break;
+                }
+                available = total;
+
+            } else if( result == Decoder::corrupt ) {
+                output[outputLength++] = '!';
+
+            } else {
+                memcpy( output + outputLength, ptr, length );
+                outputLength += length;
+                output[outputLength++] = ';';
+            }
+            ptr = next;
+        }
+
+        output[outputLength] = '\0';
+        check( strcmp( output, decodeCase.expect ) == 0, decodeCase.what );
+        delete decoder;
+    }
+};
+
+
+
+//
+// the timer heap: deadlines scheduled, moved earlier and later and
+// cancelled come out earliest first, checked against a plain table
+//
+void testTimers() {
+    Timers timers;
+    char *block = (char *)malloc( Timers::tableSize( timerFiles ) );
+    timers.tables( block, timerFiles );
+
+    long_time_t expect[timerFiles];
+    unsigned long random = 1;
+    for( nfds_t index = 0; index < timerFiles; ++index ) {
+        random = random * 1103515245 + 12345;
+        expect[index] = (random >> 8) % 1000;
+        timers.schedule( index, expect[index] );
+    }
+
+    // move every third earlier or later and cancel every seventh
+    for( nfds_t index = 0; index < timerFiles; index += 3 ) {
+        random = random * 1103515245 + 12345;
+        expect[index] = (random >> 8) % 1000;
+        timers.schedule( index, expect[index] );
+    }
+    for( nfds_t index = 0; index < timerFiles; index += 7 ) {
+        expect[index] = FOREVER;
+        timers.cancel( index );
+    }
+    timers.cancel( 7 );         // twice
+
+    bool ordered = true;
+    bool matched = true;
+    long_time_t previous = 0;
+    nfds_t popped = 0;
+    while( timers.next() != FOREVER ) {
+        const nfds_t index = timers.first();
+        const long_time_t deadline = timers.next();
+        ordered = ordered && deadline >= previous;
+        matched = matched && index < timerFiles && deadline == expect[index];
+        expect[index] = FOREVER;
+        previous = deadline;
+        timers.cancel( index );
+        ++popped;
+    }
+
+    check( ordered, "timers come out earliest first" );
+    check( matched, "timers keep their deadlines" );
+    check( popped == timerFiles - (timerFiles + 6) / 7, "timers cancelled" );
+    free( block );
+};
+
+
+
+//
+// the debounce stage: a fixed --debounce, and --debounce auto learning
+// the window from actuations of three edges over 1ms, a second apart
+//
+void testDebounce() {
+    PFDOption option;
+    option.init();
+    option.debounce = 5 * MILLISECOND;
+    check( !Debounce::settled( option, 10 * MILLISECOND, 14 * MILLISECOND ), "debounce holds a bouncing line" );
+    check( Debounce::settled( option, 10 * MILLISECOND, 15 * MILLISECOND ), "debounce settles" );
+
+    Bounce bounce;
+    bounce.init();
+    check( bounce.window() == debounceAutoMax, "learning starts from the longest window" );
+
+    const unsigned int actuations = 200;
+    unsigned int completed = 0;
+    for( unsigned int actuation = 0; actuation < actuations; ++actuation ) {
+        const long_time_t time = actuation * 1000 * MILLISECOND;
+        completed += bounce.line( time );
+        bounce.line( time + MILLISECOND / 2 );
+
+        // one actuation bounces for 20ms
+        bounce.line( time + (actuation == 50 ? 20 : 1) * MILLISECOND );
+    }
+
+    // the last actuation is only complete once the next line comes
+    check( completed == actuations - 1 && bounce.actuations == actuations - 1, "learning counts actuations" );
+    check( bounce.edges == 3 * (actuations - 1), "learning counts edges" );
+    check( bounce.envelopeMax == 20 * MILLISECOND, "learning keeps the longest bounce" );
+    check( bounce.window() == Bounce::bound( 3 ), "learning covers 99% of the bounces" );
+};
+
+
+
+//
+// the gate after the debounce stage: --coalesce 100 spaces lines out, and
+// --max-rate 3/s lets a burst of three through then one a third of a
+// second, for lines offered every millisecond
+//
+void testGate() {
+    PFDOption option;
+    option.init();
+    option.coalesce = 100 * MILLISECOND;
+
+    // line times are monotonic, well after the gate's start at 0
+    const long_time_t base = 1000000 * MILLISECOND;
+
+    Debounce debounce;
+    debounce.init();
+    check( debounce.open( option, base ), "coalesce lets the first line through" );
+    debounce.emitted( option, base );
+    check( !debounce.open( option, base + 50 * MILLISECOND ), "coalesce holds a line" );
+    check( debounce.deadline( option, base + 50 * MILLISECOND ) == base + 100 * MILLISECOND, "coalesce holds a line until the interval" );
+    check( debounce.open( option, base + 100 * MILLISECOND ), "coalesce lets a line through after the interval" );
+
+    // as --max-rate 3/s
+    option.init();
+    option.rateInterval = 1000 * MILLISECOND / 3;
+    option.rateTolerance = 2 * option.rateInterval;
+    debounce.init();
+
+    long_time_t emitted[16];
+    unsigned int count = 0;
+    for( long_time_t time = base; time < base + 2000 * MILLISECOND && count < 16; time += MILLISECOND ) {
+        if( debounce.open( option, time ) ) {
+            debounce.emitted( option, time );
+            emitted[count++] = time;
+        }
+    }
+
+    const long_time_t expect[] = { 0, 1, 2, 334, 667, 1000, 1334, 1667 };
+    bool matched = count == sizeof( expect ) / sizeof( expect[0] );
+    for( unsigned int index = 0; matched && index < count; ++index ) {
+        matched = emitted[index] == base + expect[index] * MILLISECOND;
+    }
+    check( matched, "max-rate allows a burst then the rate" );
+
+    // an idle bucket refills to the burst, no more
+    unsigned int burst = 0;
+    for( long_time_t time = base + 10000 * MILLISECOND; time < base + 10010 * MILLISECOND; time += MILLISECOND ) {
+        if( debounce.open( option, time ) ) {
+            debounce.emitted( option, time );
+            ++burst;
+        }
+    }
+    check( burst == 3, "max-rate refills to the burst" );
+};
+
+
+
+//
+// the format stage: each field written to an Output with a Sink
+//
+void testFormat() {
+    Collect collect;
+    Output output;
+    output.setSink( &collect );
+
+    Format format( "+%p:%l %T %c %%\n" );
+    Timestamp read;
+    read.monotonic = 42;
+    read.epoch = 7;
+
+    Format::Fields fields;
+    memset( &fields, 0, sizeof( fields ) );
+    fields.line = "abc";
+    fields.length = 3;
+    fields.path = "file";
+    fields.pathLength = 4;
+    fields.read = &read;
+    fields.suppressed = 2;
+
+    output.start();
+    format.write( output, fields );
+    output.end();
+    check( collect.is( "file:abc 42 2 %\n" ), "format the fields" );
+};
+
+
+
+//
+// an EventLoop reading a named pipe, with --unique, into a Sink
+//
+void testLoop() {
+    char directory[] = "/tmp/libpolltest.XXXXXX";
+    if( !mkdtemp( directory ) ) {
+        perror( "mkdtemp" );
+        ++failures;
+        return;
+    }
+    char path[sizeof( directory ) + 8];
+    snprintf( path, sizeof( path ), "%s/fifo", directory );
+    if( mkfifo( path, 0600 ) < 0 ) {
+        perror( path );
+        ++failures;
+        rmdir( directory );
+        return;
+    }
+
+    Collect collect;
+    EventLoop loop;
+    PFDOption option;
+    option.init();
+    option.duplicates = false;
+
+    if( loop.init( 1 ) && loop.add( path, option ) != loop.pfdMax && loop.listen() ) {
+        loop.output.setSink( &collect );
+
+        Timestamp now;
+        now.read();
+        loop.start( now );
+
+        const int fd = open( path, O_WRONLY | O_NONBLOCK );
+        const char input[] = "a\na\nb\nc";
+        check( fd >= 0 && write( fd, input, sizeof( input ) - 1 ) == sizeof( input ) - 1, "write to the pipe" );
+
+        const long_time_t deadline = now.monotonic + loopTimeout;
+        while( collect.length < 4 && now.monotonic < deadline && loop.run( now, deadline ) ) {
+        }
+        check( collect.is( "a\nb\n" ), "loop output unique lines" );
+        check( !loop.failed(), "loop carries on" );
+        if( fd >= 0 ) {
+            close( fd );
+        }
+
+    } else {
+        check( false, "open the pipe" );
+    }
+
+    unlink( path );
+    rmdir( directory );
+};
+
+
+
+//
+// main
+//
+int main() {
+    testDelimiters();
+    testDecoders();
+    testDebounce();
+    testGate();
+    testFormat();
+    testTimers();
+    testLoop();
+
+    if( !failures ) {
+        printf( "libpolltest: all passed\n" );
+    }
+    return failures;
+};
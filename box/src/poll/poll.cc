@@ -20,552 +20,784 @@
 // /sys/class/gpio/gpioX/value style files.  It outputs lines from
 // the updated file, optionally with filename and a timestamp.
 //
-
-//
-// Philosophy:
-// As poll is generally responding to real-time events; it tries to be
-// as time efficient as possible.  String handling is all C style rather
-// than C++ Strings. There is no mallocing of space (there may be some
-// within library routines but we have no control of this) and no dynamic
-// creation of class instances during the main loop.
+// This is the command line: the options are parsed into an EventLoop
+// from libpoll.h, which does the work.
 //
-// Input lines are read into fixed length, pre-allocated buffers and
-// transferred to an output buffer for sending on its way in an atomic
-// operation.
+// --control commands are the exception to there being no mallocing during
+// the main loop: a command is copied to be split into words, its
+// --delimiters, --decode and +FORMAT are built, and a file added with a
+// longer --max-line than the rings were sized for gets its own ring.
+// Whatever a command doesn't leave with a file is freed at once, what it
+// does is counted against the files holding it and freed when the last of
+// them is removed or retuned away from it.
 //
 
 
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <unistd.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <poll.h>
-#include <string.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <algorithm>
-
+#include "libpoll.h"
 
 
-// Maximum line length
-const unsigned int bufferSize = 1024;
-
-// Nanoseconds since Unix Epoch
-typedef uint64_t long_time_t;
-const long_time_t FOREVER = -1;
 
 // Translate \x character sequences in STRING arguments
 char lookupChr[] = "abfnrtv\\123456789";
 char translateChr[] = "\a\b\f\n\r\t\v\\\001\002\003\004\005\006\007\010\011";
 
-// % options in format strings
-char formatChr[] = "lpt";
+// Spare slots in the per file tables for files added through --control
+const nfds_t controlSpare = 32;
+
+// Most words in a control command
+const int controlWordMax = 64;
 
-// Maximum number of files
-const nfds_t pfdMax = 64;
+// Set by SIGUSR1 to write statistics to stderr
+volatile sig_atomic_t statsRequested = 0;
 
-// Global variable of number of files
-nfds_t pfdCount = 0;
 
 
+//
+// The files, statistics and, with --threads or --replay, what runs them
+//
+EventLoop loop;
+Stats stats;
+Workers workers;
+Replay replay;
+
 
+
+//
+// Argument class
 //
-// Output class
+// A singleton class to parse the arguments to set up the loop's files, and
+// run the commands read from its --control fifo
 //
-// This is a singleton class (could probably be a namespace) to
-// copy data to a buffer and then, hopefully, atomically write it
-// all to the output stream.  Should be atomic if outputSize is
-// less then PIPE_BUFSIZE - though this isn't checked.
+// Arguments:
+// filename             File to monitor
+// +format              Format for output, line: %l, time: %t %T %d, file: %p
+// -debounce N|auto     Number of milliseconds to ignore results or learn it
+// --unique             Discard repeated results (useful with debounce)
+// --duplicates         Report repeated results
+// --delimiters         Characters which delimit input lines
+// --decode NAME        Split and check records: rfid125, fixed:N, hex or lines
+// --max-line N         Longest line before it is split
+// --quadrature N       Decode a gpiochip pair as +1/-1 every N edges
+// --coalesce MS        Output at most one line, the latest, every MS
+// --max-rate N/s|N/m   Limit lines output with a token bucket
+// --default            Reset default options for subsequent files
+// --readtime           Timestamp data as it is read
+// --looptime           Timestamp data when poll wakes up (default)
+// --backend NAME       Wait for events using poll or epoll
+// --batch              Write all the lines from one wakeup together
+// --binary             Write binary frames instead of formatted lines
+// --shm NAME           Publish output to a shared memory ring
+// --stats FILE         Write statistics to a file or fifo periodically
+// --stats-interval MS  Time between writes to the stats file
+// --control FIFO       Read add, remove and retune commands from a fifo
+// --reopen             Reopen files which are lost, with backoff
+// --threads N          Share the files between N worker threads
+// --reorder MS         Time a worker's line waits to be merged in order
+// --record FILE        Log every read, with its time, for --replay
+// --replay FILE        Feed a --record log through the files instead
+// --speed X|max        Replay at X times real time (default 1) or flat out
 //
-class Output {
+
+class Argument : public Listener {
 private:
-    static const unsigned int outputSize = 2*bufferSize;
-    char outputBuf[outputSize];
-    unsigned int outputPos;
+    // a control command's words, which pathnames and formats point into
+    struct Command {
+        unsigned int users;     // files and option objects holding it
+    };
 
-public:
-    //
-    // start a new line of output
-    //
-    void start() {
-        outputPos = 0;
+    // what a file added or retuned by a control command holds, NULL for
+    // the command line's (never freed) and the defaults
+    struct Held {
+        Command *path;          // the add which named it
+        Format *format;
+        Command *formatCommand;
+        Delimiters *delimiters;
+        Command *delimitersCommand;
+        Decoder *decoder;
+        Command *decoderCommand;
     };
 
+    PFDOption option;           // Output options
+    bool watch;                 // --reopen or --control so watch for lost files reappearing
+    unsigned int lineMax;       // longest --max-line, the rings are sized for it
 
+    // built by the options since a file last took them, freed if none does
+    Delimiters *newDelimiters;
+    Decoder *newDecoder;
+    Format *newFormat;
+
+    Held *held;                 // per file, with --control
 
     //
-    // Add a string to the output buffer
+    // parse the backslashes in a string
     //
-    const int string( const char *str ) {
-        const unsigned int len = strlen( str );
-
-        if( len < outputSize - outputPos ) {
-            strcpy( outputBuf + outputPos, str );
-            outputPos += len;
-
-        } else {
-            outputPos = outputSize;
+    char *parseString( char *arg ) {
+        // arg = strdup( arg );         // Uncomment if arguments are not writeable
+        char *ptr;
+        for( ptr = arg; *ptr; ++ptr ) {
+            if( *ptr == '\\' ) {
+                char *find = strchr( lookupChr, ptr[1] );
+                if( find ) {
+                    // replace with translated character and shift everything up
+                    *ptr = translateChr[ find - lookupChr ];
+                    memmove( ptr+1, ptr+2, strlen( ptr+2 ) + 1 );   // strcpy can't overlap
+                }
+            }
         }
-
-        return len;
+        return arg;
     };
 
 
 
     //
-    // Add a long real to the output buffer
+    // the value of the option at argv[arg], moving arg on to it
+    // returns NULL (after a message) if it is missing
     //
-    const int real( const long_time_t val ) {
-        const int len = snprintf( outputBuf + outputPos, outputSize - outputPos, "%llu", val );
-
-        if( len >= 0 ) {
-            outputPos += len;
-
-        } else {
-            outputPos = outputSize;
+    char *value( const int argc, char **argv, int &arg ) {
+        if( arg + 1 >= argc ) {
+            fprintf( stderr, "Missing value: %s\n", argv[arg] );
+            return NULL;
         }
-
-        return len;
+        return argv[++arg];
     };
 
 
 
     //
-    // flush the output buffer to stdout
+    // parse an option which applies to the files after it
+    // returns 1 if argv[arg] was one, 0 if it wasn't or -1 (after a
+    // message) if it was invalid
     //
-    void flush() {
-        if( write( STDOUT_FILENO, outputBuf, outputPos ) < 0 ) {
-            perror( "write" );
-            exit( 1 );
-        }
-    };
+    int fileOption( const int argc, char **argv, int &arg ) {
+        char *val;
 
-} output;
+        if( strcmp( argv[arg], "--default" ) == 0 ) {
+            option.init();
 
+        } else if( strcmp( argv[arg], "--unique" ) == 0 ) {
+            option.duplicates = false;
 
+        } else if( strcmp( argv[arg], "--duplicate" ) == 0 ) {
+            option.duplicates = true;
 
-//
-// PFDOption class
-//
-// Poll file descriptor options associated with output
-//
-class PFDOption {
-public:
-    char *format;               // Start of format string
-    char *formatEnd;            // End of format string
-    char *delimiters;           // Line end delimiters
-    long_time_t debounce;       // Time to wait for value to settle
-    bool duplicates;            // Allow duplicate values to be sent onwards
-
-    void init() {
-        format = (char *)"l\n";
-        formatEnd = format + strlen( format );
-        delimiters = (char *)"\n";
-        debounce = 0;
-        duplicates = true;
-    };
-};
-
-
+        } else if( strcmp( argv[arg], "--delimiters" ) == 0 ) {
+            if( !(val = value( argc, argv, arg )) ) {
+                return -1;
+            }
+            delete newDelimiters;
+            option.delimiters = newDelimiters = new Delimiters( parseString( val ) );
 
-//
-// Poll File descriptor provided by poll.h
-// Would be nice to include these as part of PFDFileDescriptor class
-// but they have to be in their own array for poll.
-//
-// nfds_t                       // pfdIndex type
-// pfd[pfdIndex].fd             // File descriptor
-// pfd[pfdIndex].events         // Events we're interested in
-// pfd[pfdIndex].revents        // Events that happened
-//
-struct pollfd pfd[pfdMax];      // structure used by poll.h
+        } else if( strcmp( argv[arg], "--decode" ) == 0 ) {
+            if( !(val = value( argc, argv, arg )) ) {
+                return -1;
+            }
+            Decoder *decoder = NULL;
+            if( strcmp( val, "lines" ) != 0 && !(decoder = Decoder::create( val )) ) {
+                fprintf( stderr, "Unknown decoder: %s\n", val );
+                return -1;
+            }
+            delete newDecoder;
+            option.decoder = newDecoder = decoder;
 
+        } else if( strcmp( argv[arg], "--debounce" ) == 0 ) {
+            if( !(val = value( argc, argv, arg )) ) {
+                return -1;
+            }
+            option.debounceAuto = strcmp( val, "auto" ) == 0;
+            errno = 0;
+            option.debounce = option.debounceAuto ? debounceAutoMax : (long_time_t)strtoul( val, NULL, 0 ) * MILLISECOND;
+            if( errno ) {
+                perror( "debounce" );
+                return -1;
+            }
 
+        } else if( strcmp( argv[arg], "--max-line" ) == 0 ) {
+            if( !(val = value( argc, argv, arg )) ) {
+                return -1;
+            }
+            option.lineMax = strtoul( val, NULL, 0 );
+            if( option.lineMax == 0 ) {
+                fprintf( stderr, "Invalid max-line: %s\n", val );
+                return -1;
+            }
 
-//
-// Poll file descriptor class
-//
-// Handle a file descriptor and all its associated options
-//
-// pollFileDescriptor[pfdMax]
+        } else if( strcmp( argv[arg], "--quadrature" ) == 0 ) {
+            if( !(val = value( argc, argv, arg )) ) {
+                return -1;
+            }
+            option.quadrature = strtoul( val, NULL, 0 );
+            if( option.quadrature != 1 && option.quadrature != 2 && option.quadrature != 4 ) {
+                fprintf( stderr, "Invalid quadrature: %s\n", val );
+                return -1;
+            }
 
-class PollFileDescriptor {
-private:
-    nfds_t index;               // Copy of the array index
+        } else if( strcmp( argv[arg], "--reopen" ) == 0 ) {
+            option.reopen = true;
 
-    char *pathname;
+        } else if( strcmp( argv[arg], "--coalesce" ) == 0 ) {
+            if( !(val = value( argc, argv, arg )) ) {
+                return -1;
+            }
+            char *end;
+            option.coalesce = (long_time_t)strtoul( val, &end, 0 ) * MILLISECOND;
+            if( *end && strcmp( end, "ms" ) != 0 ) {
+                fprintf( stderr, "Invalid coalesce: %s\n", val );
+                return -1;
+            }
 
-    struct stat status;         // Status of the pathname
-    int openMode;               // Pipes are opened read/write to keep them from being closed
-    short pollEvents;           // Special files use priority polling
-    bool reseek;                // Special files must seek to 0 before read
+        } else if( strcmp( argv[arg], "--max-rate" ) == 0 ) {
+            if( !(val = value( argc, argv, arg )) ) {
+                return -1;
+            }
+            char *end;
+            const unsigned long rate = strtoul( val, &end, 0 );
+            long_time_t unit;
+            if( rate && (!*end || strcmp( end, "/s" ) == 0) ) {
+                unit = 1000 * MILLISECOND;
 
-    long_time_t readTime;       // Time data last read from device
+            } else if( rate && strcmp( end, "/m" ) == 0 ) {
+                unit = 60000 * MILLISECOND;
 
-    PFDOption option;           // Output options
+            } else {
+                fprintf( stderr, "Invalid max-rate: %s\n", val );
+                return -1;
+            }
 
-    //
-    // buffer system is coded with the kind of efficiency that caused the
-    // heartbleed bug - be warned!
-    //
-    static const unsigned int bufferCount = 3;
+            // a burst of up to rate lines then one every interval
+            option.rateInterval = unit / rate;
+            option.rateTolerance = (rate - 1) * option.rateInterval;
 
-    char buffer[bufferCount][bufferSize];
-    uint8_t bufferIndex;
-    char *readPtr;      // start of buffer unless previous data unfinished
-    char *printPtr;     // last printed data (usually in a different buffer)
-    char *heldPtr;      // held data from debounce
+        } else if( strcmp( argv[arg], "--readtime" ) == 0 ) {
+            option.readStamp = true;
 
+        } else if( strcmp( argv[arg], "--looptime" ) == 0 ) {
+            option.readStamp = false;
 
+        } else if( *argv[arg] == '+' ) {
+            Format *format = new Format;
+            if( !format->compile( parseString( argv[arg] ) ) ) {
+                delete format;
+                return -1;
+            }
+            delete newFormat;
+            option.format = newFormat = format;
 
-public:
-    //
-    // check status and set modes for a pathname
-    //
-    void statpfd() {
-        if( stat( pathname, &status ) < 0 ) {
-            perror( pathname );
-            exit( 1 );
+        } else {
+            return 0;
         }
 
-        // system file e.g. /sys/class/gpio/gpioN/value
-        if( S_ISREG( status.st_mode ) ) {
-            openMode = O_RDONLY;
-            pollEvents = POLLPRI;
-            reseek = true;
+        return 1;
+    };
 
-        // character device e.g. /dev/ttyUSB0
-        } else if( S_ISCHR( status.st_mode ) ) {
-            openMode = O_RDONLY | O_NONBLOCK;
-            pollEvents = POLLIN;
-            reseek = false;
 
-        // fifo e.g. /tmp/fifo
-        } else if( S_ISFIFO( status.st_mode ) ) {
-            openMode = O_RDWR | O_NONBLOCK;
-            pollEvents = POLLIN;
-            reseek = false;
 
-        } else {
-            fprintf( stderr, "Invalid device: %s\n", pathname );
-            exit( 1 );
-        }
-    };
+    //
+    // split a control command into words in place
+    // quotes (single or double) group words containing spaces
+    // returns the number of words or -1 if there are too many
+    //
+    int split( char *line, char **words ) {
+        int count = 0;
+        char *ptr = line;
 
+        while( true ) {
+            while( *ptr == ' ' || *ptr == '\t' ) {
+                ++ptr;
+            }
+            if( !*ptr ) {
+                break;
+            }
+            if( count == controlWordMax ) {
+                return -1;
+            }
 
+            char *out = ptr;
+            words[count++] = out;
 
-    //
-    // open the file descriptor and set the modes
-    //        
-    void openpfd( const nfds_t pfdi, char *fname, PFDOption *argOption ) {
-        index = pfdi;
-        pathname = fname;
+            char quote = '\0';
+            while( *ptr && (quote || (*ptr != ' ' && *ptr != '\t')) ) {
+                if( quote ? *ptr == quote : (*ptr == '\'' || *ptr == '"') ) {
+                    quote = quote ? '\0' : *ptr;
+                    ++ptr;
 
-        statpfd();
+                } else {
+                    *out++ = *ptr++;
+                }
+            }
 
-        pfd[index].fd = open( pathname, openMode );
-        if( pfd[index].fd < 0 ) {
-            perror( pathname );
-            exit( 1 );
+            const bool last = !*ptr;
+            *out = '\0';
+            if( last ) {
+                break;
+            }
+            ++ptr;
         }
-        pfd[index].events = pollEvents;
-
-        readTime = 0;
-        option = *argOption;
 
-        printPtr = &(buffer[0][0]);
-        *printPtr = '\0';
-        bufferIndex = 1;
-        readPtr = &(buffer[1][0]);
-        heldPtr = NULL;
+        words[count] = NULL;
+        return count;
     };
 
 
 
     //
-    // Check readable data, debounce and held data for uniqueness
+    // hold a command for a file or option object pointing into it
     //
-    long_time_t checkpfd( long_time_t now ) {
-
-        // debouncing is done by holding back data instead of printing
-        // which appears within debounce time.  If device is quiet for debounce
-        // time then print the held data if it's different to the last output
-        // otherwise silently discard it
-        //
-        // This method gives quickest response to any change on the device while
-        // dropping bounce information and still reporting final state in case
-        // it differs
+    void hold( Command *command ) {
+        ++command->users;
+    };
 
-        bool nobounce = now - readTime >= option.debounce;
 
-        // held data from a debounce might need printing
-        if( heldPtr && nobounce ) {
-            printpfd( heldPtr );
-            heldPtr = NULL;
-        }
 
-        // shouldn't get an end of file - but in case we do
-        if( pfd[index].revents & POLLHUP ) {
-            fprintf( stderr, "EOF: %s\n", pathname );
-            pfd[index].fd = -1;                // disable polling fd
+    //
+    // let go of a command, freeing it once nothing points into it
+    //
+    void drop( EventLoop &loop, Command *command ) {
+        if( command && --command->users == 0 ) {
+            loop.output.flush();    // batched lines may point into its formats
+            free( command );
         }
+    };
 
-        // if there's data to read then parse it
-        if( (pfd[index].revents & pfd[index].events) && readpfd() ) {
-            readTime = now;
-            char *startPtr = &(buffer[bufferIndex][0]);
-            char *eolPtr;
-
-            // step through the lines in the buffer
-            while( (eolPtr = strpbrk( startPtr, option.delimiters )) ) {
-                *eolPtr = '\0';         // overwrite with C string delimiter
-
-                if( nobounce ) {
-                    printpfd( startPtr );
-        
-                } else {
-                    heldPtr = startPtr; // hold instead of print if bouncing
-                }
-
-                startPtr = eolPtr + 1;
-                nobounce = option.debounce == 0;   // in case >1 line in buffer
-            }
 
-            // find a buffer which doesn't have printPtr or heldPtr in it
-            uint8_t buffersUsed = bufferOf( printPtr ) | bufferOf( heldPtr );
-            for( bufferIndex = 0; buffersUsed & (1<<bufferIndex); ++bufferIndex ) {
-                // shouldn't ever happen
-                if( bufferIndex >= bufferCount ) {
-                    fprintf( stderr, "No free buffers: %s\n", pathname );
-                    exit( 1 );
-                }
-            }
-            readPtr = &(buffer[bufferIndex][0]);
 
-            // copy partial line to beginning of buffer
-            unsigned int remainder = strlen( startPtr );
-            if( remainder ) {
-                strncpy( readPtr, startPtr, remainder );
-                readPtr += remainder;
+    //
+    // is an option object still held by any file
+    //
+    bool shared( EventLoop &loop, const void *object ) {
+        for( nfds_t pfdIndex = 0; pfdIndex < loop.pfdCount; ++pfdIndex ) {
+            if( held[pfdIndex].format == object || held[pfdIndex].delimiters == object || held[pfdIndex].decoder == object ) {
+                return true;
             }
         }
-
-        // if held data then return the time we need to be checked again
-        return heldPtr ? option.debounce - (now - readTime) : FOREVER;
+        return false;
     };
 
 
 
     //
-    // bufferOf - returns bit set of buffer which pointer is in
+    // a file's option object changed: hold the new one if the command
+    // built it, and free the old one if no other file still holds it
     //
-    uint8_t bufferOf( char *ptr ) {
-        return ptr ? 1 << ((ptr - &(buffer[0][0])) / bufferSize) : 0;
+    template <class T> void change( EventLoop &loop, T *&object, Command *&objectCommand, T *now, const bool built, Command *command ) {
+        T *old = object;
+        Command *oldCommand = objectCommand;
+
+        object = built ? now : NULL;
+        objectCommand = built ? command : NULL;
+        if( built ) {
+            hold( command );
+        }
+
+        if( old && !shared( loop, old ) ) {
+            loop.output.flush();
+            delete old;
+        }
+        drop( loop, oldCommand );
     };
 
 
 
     //
-    // read from a pfd
+    // note what a file's options hold of the command which added or
+    // retuned it, only the objects which changed for a retune
     //
-    unsigned int readpfd() {
-        int charCount;
-        if( reseek ) {
-            lseek( pfd[index].fd, 0, SEEK_SET );
+    void use( EventLoop &loop, const nfds_t pfdIndex, const PFDOption &before, Command *command ) {
+        Held &file = held[pfdIndex];
+        if( option.format != before.format ) {
+            change( loop, file.format, file.formatCommand, option.format, option.format != &defaultFormat, command );
         }
-
-        charCount = read( pfd[index].fd, readPtr, bufferSize-2 + &(buffer[bufferIndex][0]) - readPtr );
-        if( charCount < 0 ) {
-            if( errno == EAGAIN || errno == EWOULDBLOCK ) {
-                return 0;
-
-            } else {
-                perror( "read" );
-                exit( 1 );        // or should we set pfd[index].fd to -1?
-            }
+        if( option.delimiters != before.delimiters ) {
+            change( loop, file.delimiters, file.delimitersCommand, option.delimiters, option.delimiters != &defaultDelimiters, command );
         }
-
-        readPtr += charCount;
-        // if not enough room in buffer then pretend it was a complete line
-        if( readPtr == bufferSize-2 + &(buffer[bufferIndex][0]) ) {
-            *(readPtr++) = *option.delimiters;
-            ++charCount;
+        if( option.decoder != before.decoder ) {
+            change( loop, file.decoder, file.decoderCommand, option.decoder, option.decoder != NULL, command );
         }
-        *readPtr = '\0';
-        return charCount;
     };
 
 
 
     //
-    // print and update printPtr to point to what we just printed
+    // a file has been removed, let go of what it held
     //
-    void printpfd( char *startPtr ) {
-        if( *startPtr && ( option.duplicates || strcmp( printPtr, startPtr ) != 0 ) ) {
-            output.start();
-            char *formatPtr = option.format;
+    void release( EventLoop &loop, const nfds_t pfdIndex ) {
+        Held &file = held[pfdIndex];
+        change( loop, file.format, file.formatCommand, (Format *)NULL, false, NULL );
+        change( loop, file.delimiters, file.delimitersCommand, (Delimiters *)NULL, false, NULL );
+        change( loop, file.decoder, file.decoderCommand, (Decoder *)NULL, false, NULL );
+        drop( loop, file.path );
+        file.path = NULL;
+    };
 
-            while( formatPtr < option.formatEnd ) {
-                switch( *formatPtr ) {
-                case '+':
-                    break;
-                case 'l':
-                    output.string( startPtr );
-                    break;
-                case 'p':
-                    output.string( pathname );
-                    break;
-                case 't':
-                    output.real( readTime );
-                    break;
-                default:
-                    output.string( "%" );
-                    break;
-                }
 
-                // Output the next literal part of the format string
-                formatPtr += output.string( formatPtr + 1 ) + 2;
-            }
 
-            output.flush();
-            printPtr = startPtr;
-        }
+public:
+    //
+    // constructor
+    //
+    Argument() {
+        option.init();
+        watch = false;
+        lineMax = lineMaxDefault;
+        newDelimiters = NULL;
+        newDecoder = NULL;
+        newFormat = NULL;
+        held = NULL;
     };
-} pollFileDescriptor[pfdMax];
 
 
 
+    //
+    // a file has taken the options, so keep what they built
+    //
+    void taken() {
+        newDelimiters = NULL;
+        newDecoder = NULL;
+        newFormat = NULL;
+    };
 
-//
-// Argument class
-//
-// A singleton class to parse the arguments to set up the poll file descriptors
-//
-// Arguments:
-// filename             File to monitor
-// +format              Format for output, line: %l, time: %t, file: %p
-// -debounce N          Number of milliseconds to ignore results
-// --unique             Discard repeated results (useful with debounce)
-// --duplicates         Report repeated results
-// --delimiters         Characters which delimit input lines
-// --default            Reset default options for subsequent files
-//
 
-class Argument {
-private:
-    PFDOption option;           // Output options
 
     //
-    // parse the backslashes in a string
+    // free what the options built which no file took
     //
-    char *parseString( char *arg ) {
-        // arg = strdup( arg );         // Uncomment if arguments are not writeable
-        char *ptr;
-        for( ptr = arg; *ptr; ++ptr ) {
-            if( *ptr == '\\' ) {
-                char *find = strchr( lookupChr, ptr[1] );
-                if( find ) {
-                    // replace with translated character and shift everything up
-                    *ptr = translateChr[ find - lookupChr ];
-                    strcpy( ptr+1, ptr+2 );
-                }
-            }
-        }
-        return arg;
+    void discard() {
+        delete newDelimiters;
+        delete newDecoder;
+        delete newFormat;
+        taken();
     };
 
 
 
     //
-    // parse a format string
-    //
-    // Replace % with \0 to break the format string into substrings of the form:
-    // initial char
-    //          +: skip
-    //          l: output line from file
-    //          p: output filename
-    //          t: output time data was read
-    // literal string
-    //          output literal
-    // null     terminator
+    // Count the files in the command line arguments, and find the longest
+    // --max-line
     //
-    char *parseFormat( char *format ) {
-        // +%l is same as l, so shift everything up for efficiency
-        if( format[1] == '%' && strlen( format ) >= 3 && strchr( formatChr, format[2] ) ) {
-            strcpy( format, format+2 );
-        }
+    nfds_t count( const int argc, char **argv ) {
+        nfds_t files = 0;
 
-        char *ptr;
-        for( ptr = format; *ptr; ++ptr ) {
-            if( *ptr == '%' ) {
-                if( ptr[1] == '%' ) {
-                    // %%: move string up by one
-                    strcpy( ptr+1, ptr+2 );
-
-                } else if( strchr( formatChr, ptr[1] ) ) {
-                    *ptr = '\0';
-                }
+        for( int arg = 1; arg < argc; ++arg ) {
+            if( strcmp( argv[arg], "--control" ) == 0 ) {
+                files += 1 + controlSpare;
+                watch = true;
+                ++arg;
+
+            } else if( strcmp( argv[arg], "--reopen" ) == 0 ) {
+                watch = true;
+
+            } else if( strcmp( argv[arg], "--replay" ) == 0 ) {
+                loop.replay();          // before any file is opened
+                ++arg;
+
+            } else if( strcmp( argv[arg], "--max-line" ) == 0 && arg + 1 < argc ) {
+                lineMax = std::max( lineMax, (unsigned int)strtoul( argv[++arg], NULL, 0 ) );
+
+            } else if( strcmp( argv[arg], "--delimiters" ) == 0 ||
+                strcmp( argv[arg], "--decode" ) == 0 ||
+                strcmp( argv[arg], "--debounce" ) == 0 ||
+                strcmp( argv[arg], "--quadrature" ) == 0 ||
+                strcmp( argv[arg], "--coalesce" ) == 0 ||
+                strcmp( argv[arg], "--max-rate" ) == 0 ||
+                strcmp( argv[arg], "--backend" ) == 0 ||
+                strcmp( argv[arg], "--shm" ) == 0 ||
+                strcmp( argv[arg], "--stats" ) == 0 ||
+                strcmp( argv[arg], "--stats-interval" ) == 0 ||
+                strcmp( argv[arg], "--threads" ) == 0 ||
+                strcmp( argv[arg], "--record" ) == 0 ||
+                strcmp( argv[arg], "--speed" ) == 0 ||
+                strcmp( argv[arg], "--reorder" ) == 0 ) {
+                ++arg;          // skip the option's value
+
+            } else if( *argv[arg] != '-' && *argv[arg] != '+' ) {
+                ++files;
             }
         }
-        return ptr;
+
+        return watch ? files + 1 : files;
     };
 
 
 
-public:
-    //
-    // constructor
-    //
-    Argument() {
-        option.init();
-    };
-
     //
     // Parse the command line arguments
     //
     void parse( const int argc, char **argv ) {
+        if( !loop.init( count( argc, argv ), lineMax ) ) {
+            exit( 1 );
+        }
+
+        // --reopen files add watches as they are opened
+        if( watch && !loop.watch() ) {
+            exit( 1 );
+        }
+
+        char *control = NULL;
+        char *val;
+
         for( int arg = 1; arg < argc; ++arg ) {
-            if( strcmp( argv[arg], "--default" ) == 0 ) {
-                option.init();
+            const int result = fileOption( argc, argv, arg );
+            if( result < 0 ) {
+                exit( 1 );
+
+            } else if( result > 0 ) {
+                continue;
+
+            } else if( strcmp( argv[arg], "--backend" ) == 0 ) {
+                if( !(val = value( argc, argv, arg )) ) {
+                    exit( 1 );
+                }
+                if( !loop.backend.select( val ) ) {
+                    exit( 1 );
+                }
+
+            } else if( strcmp( argv[arg], "--batch" ) == 0 ) {
+                loop.output.setBatch( true );
+
+            } else if( strcmp( argv[arg], "--binary" ) == 0 ) {
+                // frames number their files in 16 bits
+                if( loop.pfdMax > frameSourceMax ) {
+                    fprintf( stderr, "--binary can't be used with more than %u files\n", (unsigned int)frameSourceMax );
+                    exit( 1 );
+                }
+                loop.output.setBinary( true );
+
+            } else if( strcmp( argv[arg], "--shm" ) == 0 ) {
+                if( !(val = value( argc, argv, arg )) ) {
+                    exit( 1 );
+                }
+                if( !loop.output.setShm( val ) ) {
+                    exit( 1 );
+                }
 
-            } else if( strcmp( argv[arg], "--unique" ) == 0 ) {
-                option.duplicates = false;
+            } else if( strcmp( argv[arg], "--stats" ) == 0 ) {
+                if( !(val = value( argc, argv, arg )) ) {
+                    exit( 1 );
+                }
+                if( !stats.setFile( val ) ) {
+                    exit( 1 );
+                }
 
-            } else if( strcmp( argv[arg], "--duplicate" ) == 0 ) {
-                option.duplicates = true;
+            } else if( strcmp( argv[arg], "--stats-interval" ) == 0 ) {
+                if( !(val = value( argc, argv, arg )) ) {
+                    exit( 1 );
+                }
+                const long_time_t interval = (long_time_t)strtoul( val, NULL, 0 ) * MILLISECOND;
+                if( interval == 0 ) {
+                    fprintf( stderr, "Invalid stats-interval: %s\n", val );
+                    exit( 1 );
+                }
+                stats.setInterval( interval );
 
-            } else if( strcmp( argv[arg], "--delimiters" ) == 0 ) {
-                option.delimiters = parseString( argv[++arg] );
+            } else if( strcmp( argv[arg], "--control" ) == 0 ) {
+                if( !(control = value( argc, argv, arg )) ) {
+                    exit( 1 );
+                }
 
-            } else if( strcmp( argv[arg], "--debounce" ) == 0 ) {
-                option.debounce = strtoul( argv[++arg], NULL, 0 ) * 1000;
-                if( errno ) {
-                    perror( "debounce" );
+            } else if( strcmp( argv[arg], "--record" ) == 0 ) {
+                if( !(val = value( argc, argv, arg )) ) {
+                    exit( 1 );
+                }
+                // frames number their files in 16 bits
+                if( loop.pfdMax > frameSourceMax ) {
+                    fprintf( stderr, "--record can't be used with more than %u files\n", (unsigned int)frameSourceMax );
+                    exit( 1 );
+                }
+                if( !loop.record( val ) ) {
+                    exit( 1 );
+                }
+
+            } else if( strcmp( argv[arg], "--replay" ) == 0 ) {
+                if( !(val = value( argc, argv, arg )) ) {
+                    exit( 1 );
+                }
+                if( !replay.open( val ) ) {
                     exit( 1 );
                 }
 
+            } else if( strcmp( argv[arg], "--speed" ) == 0 ) {
+                if( !(val = value( argc, argv, arg )) ) {
+                    exit( 1 );
+                }
+                // count() has seen any --replay, wherever it is
+                if( !loop.replaying ) {
+                    fprintf( stderr, "--speed can only be used with --replay\n" );
+                    exit( 1 );
+                }
+                const double speed = strcmp( val, "max" ) == 0 ? 0 : strtod( val, NULL );
+                if( speed < 0 || (speed == 0 && strcmp( val, "max" ) != 0) ) {
+                    fprintf( stderr, "Invalid speed: %s\n", val );
+                    exit( 1 );
+                }
+                replay.setSpeed( speed );
+
+            } else if( strcmp( argv[arg], "--threads" ) == 0 ) {
+                if( !(val = value( argc, argv, arg )) ) {
+                    exit( 1 );
+                }
+                const unsigned long threads = strtoul( val, NULL, 0 );
+                // one worker would only add the merge to a single loop
+                if( threads < 2 || threads > threadsMax ) {
+                    fprintf( stderr, "Invalid threads: %s\n", val );
+                    exit( 1 );
+                }
+                workers.setCount( threads );
+
+            } else if( strcmp( argv[arg], "--reorder" ) == 0 ) {
+                if( !(val = value( argc, argv, arg )) ) {
+                    exit( 1 );
+                }
+                const long_time_t window = (long_time_t)strtoul( val, NULL, 0 ) * MILLISECOND;
+                if( window == 0 ) {
+                    fprintf( stderr, "Invalid reorder: %s\n", val );
+                    exit( 1 );
+                }
+                workers.setWindow( window );
+
             } else if( *argv[arg] == '-' ) {
                 fprintf( stderr, "Unknown option: %s\n", argv[arg] );
                 exit( 1 );
 
-            } else if( *argv[arg] == '+' ) {
-                option.format = parseString( argv[arg] );
-                option.formatEnd = parseFormat( option.format );
+            } else if( loop.add( argv[arg], option ) == loop.pfdMax ) {
+                exit( 1 );
 
             } else {
-                if( pfdCount >= pfdMax ) {
-                    fprintf( stderr, "Too many files\n" );
-                    exit( 1 );
+                taken();
+            }
+        }
+
+        // files are added and reopened by the thread which finds them
+        // so the set of files is fixed when they are shared out
+        if( watch && workers.active() ) {
+            fprintf( stderr, "--threads can't be used with --control or --reopen\n" );
+            exit( 1 );
+        }
+
+        if( loop.replaying && (workers.active() || loop.recorder) ) {
+            fprintf( stderr, "--replay can't be used with --threads or --record\n" );
+            exit( 1 );
+        }
+
+        // the control fifo is read like a file, with default options, so
+        // poll can start with no other files and have them added later
+        if( control && !(held = (Held *)calloc( loop.pfdMax, sizeof( Held ) )) ) {
+            perror( "calloc" );
+            exit( 1 );
+        }
+        if( control && !loop.control( control, this ) ) {
+            exit( 1 );
+        }
+
+        // lost files are reopened as soon as their directories change
+        loop.watcher();
+
+        // options after the last file are left for the saved options
+        taken();
+    };
+
+
+
+    //
+    // run a --control command:
+    //   add [OPTIONS] [+FORMAT] FILE ...     watch more files
+    //   remove FILE ...                      stop watching files
+    //   retune FILE [OPTIONS] [+FORMAT]      change a file's options
+    // options start from the defaults for add and the file's own for retune
+    // the command's strings are kept while files or formats point into them
+    //
+    void command( EventLoop &loop, const char *line, const size_t length ) {
+        // the words follow the command's count
+        Command *command = (Command *)malloc( sizeof( Command ) + length + 1 );
+        if( !command ) {
+            perror( "malloc" );
+            return;
+        }
+        command->users = 0;
+        char *copy = (char *)(command + 1);
+        memcpy( copy, line, length );
+        copy[length] = '\0';
+
+        char *words[controlWordMax + 1];
+        const int count = split( copy, words );
+
+        if( count < 0 ) {
+            fprintf( stderr, "Control command too long\n" );
+            free( command );
+            return;
+
+        } else if( count == 0 ) {
+            free( command );
+            return;
+        }
+
+        PFDOption saved = option;
+        Timestamp now;
+        now.read();
+
+        if( strcmp( words[0], "add" ) == 0 ) {
+            option.init();
+            for( int arg = 1; arg < count; ++arg ) {
+                const int result = fileOption( count, words, arg );
+                if( result < 0 ) {
+                    break;
+
+                } else if( result == 0 && *words[arg] == '-' ) {
+                    fprintf( stderr, "Unknown control option: %s\n", words[arg] );
+                    break;
+
+                } else if( result == 0 ) {
+                    const nfds_t pfdIndex = loop.add( words[arg], option );
+                    if( pfdIndex != loop.pfdMax && loop.attach( pfdIndex, now ) ) {
+                        PFDOption defaults;
+                        defaults.init();
+                        held[pfdIndex].path = command;
+                        hold( command );
+                        use( loop, pfdIndex, defaults, command );
+                        taken();
+                    }
                 }
+            }
+
+        } else if( strcmp( words[0], "remove" ) == 0 ) {
+            for( int arg = 1; arg < count; ++arg ) {
+                const nfds_t pfdIndex = loop.find( words[arg] );
+                if( pfdIndex != loop.pfdMax && loop.source[pfdIndex].isInternal() ) {
+                    fprintf( stderr, "Can't remove: %s\n", words[arg] );
 
-                // open file and copy the current options
-                pollFileDescriptor[pfdCount].openpfd( pfdCount, argv[arg], &option );
-                ++pfdCount;
+                } else if( pfdIndex != loop.pfdMax ) {
+                    loop.remove( pfdIndex );
+                    release( loop, pfdIndex );
+                }
             }
+
+        } else if( strcmp( words[0], "retune" ) == 0 && count > 1 ) {
+            const nfds_t pfdIndex = loop.find( words[1] );
+            if( pfdIndex != loop.pfdMax ) {
+                const PFDOption before = loop.source[pfdIndex].getOption();
+                option = before;
+
+                int arg;
+                for( arg = 2; arg < count; ++arg ) {
+                    if( fileOption( count, words, arg ) <= 0 ) {
+                        fprintf( stderr, "Invalid retune option: %s\n", words[arg] );
+                        break;
+                    }
+                }
+                // a rejected retune leaves what it built to be discarded
+                if( arg == count && loop.source[pfdIndex].retunepfd( option ) ) {
+                    use( loop, pfdIndex, before, command );
+                    taken();
+                }
+            }
+
+        } else {
+            fprintf( stderr, "Unknown control command: %s\n", words[0] );
+        }
+
+        discard();
+        option = saved;
+        if( !command->users ) {
+            free( command );
         }
     };
 } arguments;
@@ -573,6 +805,14 @@ public:
 
 
 
+//
+// SIGUSR1 handler
+//
+void requestStats( int ) {
+    statsRequested = 1;
+};
+
+
 
 //
 // main
@@ -580,28 +820,62 @@ public:
 int main( const int argc, char **argv ) {
     arguments.parse( argc, argv );
 
-    if( pfdCount == 0 ) {
-        fprintf( stderr, "Usage: %s [[--default] [--debounce TIME] [--unique] [--duplicate] [--delimiters DELIMITERS] [+FORMAT] FILE] ...\n", argv[0] );
+    if( loop.pfdCount == 0 ) {
+        fprintf( stderr, "Usage: %s [[--default] [--debounce TIME|auto] [--unique] [--duplicate] [--delimiters DELIMITERS] [--decode rfid125|fixed:N|hex|lines] [--max-line N] [--quadrature 1|2|4] [--coalesce MS] [--max-rate N/s|N/m] [--reopen] [--readtime] [--looptime] [--backend poll|epoll] [--batch] [--binary] [--shm NAME] [--stats FILE] [--stats-interval MS] [--control FIFO] [--threads N] [--reorder MS] [--record FILE] [--replay FILE [--speed X|max]] [+FORMAT] FILE|gpiochipN:LINE[,LINE...][:up|:down]] ...\n", argv[0] );
         exit( 2 );
     }
 
-    struct timeval tv;
-    long_time_t now;
-    long_time_t timeout = FOREVER;
+    // the workers each listen for their share of the files
+    if( !workers.active() && !loop.listen() ) {
+        exit( 1 );
+    }
+
+    // SIGUSR1 writes statistics to stderr, it interrupts the wait so is
+    // acted on straight away
+    struct sigaction action;
+    memset( &action, 0, sizeof( action ) );
+    action.sa_handler = requestStats;
+    sigaction( SIGUSR1, &action, NULL );
+
+    Timestamp now;
+    now.read();
+    stats.start( now.monotonic );
 
-    while( true ) {
-        if( poll( pfd, pfdCount, timeout == FOREVER ? -1 : timeout / 1000 ) < 0 ) {
-            perror( "poll" );
+    // the log's clock pairs its monotonic times with the epoch
+    if( loop.recorder ) {
+        loop.recorder->write( frameClock, 0, now.monotonic, now.epoch );
+    }
+
+    // binary output starts with a frame naming each file
+    loop.start( now );
+
+    if( replay.active() ) {
+        if( !replay.start( loop, now ) ) {
             exit( 1 );
         }
 
-        gettimeofday( &tv, NULL );
-        now = (long_time_t)tv.tv_sec * 1000000 + tv.tv_usec;
+        while( replay.step( loop, now ) ) {
+            if( statsRequested ) {
+                statsRequested = 0;
+                stats.write( loop, stderr );
+            }
+        }
+        return loop.failed() ? 1 : 0;
+    }
+
+    if( workers.active() && !workers.start( loop ) ) {
+        exit( 1 );
+    }
 
-        // devices return a timeout if they need calling when they have no data (for debounce)
-        timeout = FOREVER;
-        for( nfds_t pfdIndex = 0; pfdIndex < pfdCount; ++pfdIndex ) {
-            timeout = std::min( timeout, pollFileDescriptor[pfdIndex].checkpfd( now ) );
+    while( workers.active() ? workers.run( now, stats.next ) : loop.run( now, stats.next ) ) {
+        if( statsRequested ) {
+            statsRequested = 0;
+            stats.write( loop, stderr );
         }
+        stats.check( loop, now.monotonic );
+
+        // time spent handling this wakeup
+        stats.woken( now );
     }
+    return 1;
 };
@@ -0,0 +1,552 @@
+//
+// Copyright 2013,2014,2015 Tarim
+//
+// Poll is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Poll is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with Poll.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Pollbench drives a poll binary with synthetic sources and measures it.
+// Each scenario starts poll on a set of named pipes or pseudo-terminals,
+// writes numbered lines to them at a controlled rate and burst size from
+// a generator thread and reads poll's stdout, matching each line to the
+// time it was written.  It reports:
+//
+// events/s     lines out of poll per second of the run
+// p50 .. p999  input to stdout latency in microseconds
+// cpu us/ev    poll's user and system time per line
+// sys/ev       poll's system calls per line: waits, reads and writes from
+//              poll's own statistics (SIGUSR1)
+// csw/ev       poll's context switches per line
+//
+// A sysfs value file can't be imitated outside sysfs, as only sysfs
+// raises POLLPRI on a regular file, so the pty-toggle scenarios write
+// short alternating values to a pseudo-terminal instead, with the
+// debounce and unique options a gpio value file would use.
+//
+// Usage: pollbench [--events N] [--only NAME] POLL
+//
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <algorithm>
+
+
+
+// Nanoseconds
+typedef uint64_t long_time_t;
+const long_time_t MICROSECOND = 1000;
+const long_time_t SECOND = 1000000000;
+
+// Default lines written in each scenario
+const unsigned int eventsDefault = 20000;
+
+// Most sources in a scenario
+const unsigned int sourcesMax = 64;
+
+// Longest line written
+const unsigned int lengthMax = 1000;
+
+// Time to wait for more output before giving up on missing lines
+const int idleTimeout = 1000;
+
+// Time for poll to open its files before the generator starts
+const useconds_t startDelay = 100000;
+
+
+
+//
+// Scenario
+//
+// kind     fifo: named pipes, pty: pseudo-terminals, toggle: a pseudo-
+//          terminal of alternating 0 and 1 values
+// rate     lines per second, 0 for as fast as poll takes them
+// burst    lines written together
+// length   line length, padded after the sequence number
+// ending   line ending
+// options  poll options, space separated
+//
+struct Scenario {
+    const char *name;
+    const char *kind;
+    unsigned int sources;
+    unsigned int rate;
+    unsigned int burst;
+    unsigned int length;
+    const char *ending;
+    const char *options;
+};
+
+const Scenario scenarios[] = {
+    { "fifo",                "fifo",   1,    0,  64,   32, "\n",   "" },
+    { "fifo-batch",          "fifo",   1,    0,  64,   32, "\n",   "--batch" },
+    { "fifo-paced",          "fifo",   1, 2000,   1,   32, "\n",   "" },
+    { "fifo-bursts",         "fifo",   1, 2000,  50,   32, "\n",   "" },
+    { "fifo64-poll",         "fifo",  64,    0,  64,   32, "\n",   "--backend poll" },
+    { "fifo64-epoll",        "fifo",  64,    0,  64,   32, "\n",   "--backend epoll" },
+    { "fifo-unique",         "fifo",   1,    0,  64,   32, "\n",   "--unique" },
+    { "multi-delimiter",     "fifo",   1,    0,  64,   32, "\r\n", "--delimiters \\2\\3\\r\\n" },
+    { "long-lines",          "fifo",   1,    0,   8,  900, "\n",   "" },
+    { "pty",                 "pty",    1,    0,  16,   32, "\n",   "" },
+    { "pty-toggle-debounce", "toggle", 1,  200,   1,    1, "\n",   "--debounce 1 --unique" },
+    { "pty-toggle-paced",    "toggle", 1, 2000,   1,    1, "\n",   "--unique" },
+};
+
+
+
+//
+// read the monotonic clock
+//
+long_time_t now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (long_time_t)ts.tv_sec * SECOND + ts.tv_nsec;
+};
+
+
+
+//
+// Bench class
+//
+// Runs one scenario
+//
+class Bench {
+private:
+    const Scenario *scenario;
+    unsigned int events;
+    char directory[PATH_MAX];
+
+    char path[sourcesMax][PATH_MAX];    // what poll opens
+    int fd[sourcesMax];                 // where the generator writes
+    int slave[sourcesMax];              // pseudo-terminal slaves kept open in raw mode
+
+    long_time_t *sent;                  // sent[event] write time of each line
+    long_time_t *latency;               // latency[received]
+    unsigned int received;
+
+    pid_t pid;
+    int out;                            // poll's stdout
+    int err;                            // poll's stderr
+
+    //
+    // print an error and give up
+    //
+    static void fail( const char *what ) {
+        perror( what );
+        exit( 1 );
+    };
+
+
+
+    //
+    // make the sources
+    //
+    void sources() {
+        for( unsigned int source = 0; source < scenario->sources; ++source ) {
+            slave[source] = -1;
+
+            if( strcmp( scenario->kind, "fifo" ) == 0 ) {
+                if( snprintf( path[source], PATH_MAX, "%s/fifo%u", directory, source ) >= (int)PATH_MAX ) {
+                    errno = ENAMETOOLONG;
+                    fail( directory );
+                }
+                if( mkfifo( path[source], 0600 ) < 0 ) {
+                    fail( path[source] );
+                }
+                // read/write so opening doesn't wait for poll
+                if( (fd[source] = open( path[source], O_RDWR )) < 0 ) {
+                    fail( path[source] );
+                }
+
+            } else {
+                fd[source] = posix_openpt( O_RDWR | O_NOCTTY );
+                if( fd[source] < 0 || grantpt( fd[source] ) < 0 || unlockpt( fd[source] ) < 0 ) {
+                    fail( "pty" );
+                }
+                snprintf( path[source], PATH_MAX, "%s", ptsname( fd[source] ) );
+
+                // raw, so lines aren't edited or echoed, while poll has it open
+                if( (slave[source] = open( path[source], O_RDWR | O_NOCTTY )) < 0 ) {
+                    fail( path[source] );
+                }
+                struct termios attributes;
+                tcgetattr( slave[source], &attributes );
+                cfmakeraw( &attributes );
+                tcsetattr( slave[source], TCSANOW, &attributes );
+            }
+        }
+    };
+
+
+
+    //
+    // start poll with its stdout and stderr on pipes
+    //
+    void start( const char *poll ) {
+        char options[256];
+        snprintf( options, sizeof( options ), "%s", scenario->options );
+
+        const char *argv[sourcesMax + 32];
+        int argc = 0;
+        argv[argc++] = poll;
+        for( char *word = strtok( options, " " ); word; word = strtok( NULL, " " ) ) {
+            argv[argc++] = word;
+        }
+        argv[argc++] = "+%l\\n";
+        for( unsigned int source = 0; source < scenario->sources; ++source ) {
+            argv[argc++] = path[source];
+        }
+        argv[argc] = NULL;
+
+        int outPipe[2];
+        int errPipe[2];
+        if( pipe( outPipe ) < 0 || pipe( errPipe ) < 0 ) {
+            fail( "pipe" );
+        }
+
+        if( (pid = fork()) < 0 ) {
+            fail( "fork" );
+
+        } else if( pid == 0 ) {
+            dup2( outPipe[1], STDOUT_FILENO );
+            dup2( errPipe[1], STDERR_FILENO );
+            close( outPipe[0] );
+            close( errPipe[0] );
+            execv( poll, (char **)argv );
+            fail( poll );
+        }
+
+        close( outPipe[1] );
+        close( errPipe[1] );
+        out = outPipe[0];
+        err = errPipe[0];
+        usleep( startDelay );
+    };
+
+
+
+    //
+    // the generator thread
+    //
+    static void *generate( void *arg ) {
+        ((Bench *)arg)->generate();
+        return NULL;
+    };
+
+    void generate() {
+        const unsigned int sources = scenario->sources;
+        const size_t size = (size_t)scenario->burst * (lengthMax + 4);
+        char *buffer[sourcesMax];
+        size_t length[sourcesMax];
+        for( unsigned int source = 0; source < sources; ++source ) {
+            if( !(buffer[source] = (char *)malloc( size )) ) {
+                fail( "malloc" );
+            }
+        }
+
+        const bool toggle = strcmp( scenario->kind, "toggle" ) == 0;
+        const long_time_t start = now();
+
+        for( unsigned int event = 0; event < events; ) {
+            // bursts go out on schedule, or as fast as they are taken
+            if( scenario->rate ) {
+                const long_time_t due = start + (long_time_t)event * SECOND / scenario->rate;
+                struct timespec ts;
+                ts.tv_sec = due / SECOND;
+                ts.tv_nsec = due % SECOND;
+                while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR ) {
+                }
+            }
+
+            // spread the burst over the sources
+            const unsigned int first = event;
+            const unsigned int last = std::min( event + scenario->burst, events );
+            for( unsigned int source = 0; source < sources; ++source ) {
+                length[source] = 0;
+            }
+            for( ; event < last; ++event ) {
+                const unsigned int source = event % sources;
+                char *ptr = buffer[source] + length[source];
+                int used;
+                if( toggle ) {
+                    used = sprintf( ptr, "%u", event & 1 );
+
+                } else {
+                    used = sprintf( ptr, "%u ", event );
+                    while( (unsigned int)used < scenario->length ) {
+                        ptr[used++] = 'x';
+                    }
+                }
+                used += sprintf( ptr + used, "%s", scenario->ending );
+                length[source] += used;
+            }
+
+            const long_time_t time = now();
+            for( unsigned int sent = first; sent < last; ++sent ) {
+                this->sent[sent] = time;
+            }
+            for( unsigned int source = 0; source < sources; ++source ) {
+                const char *ptr = buffer[source];
+                size_t left = length[source];
+                while( left ) {
+                    const ssize_t written = write( fd[source], ptr, left );
+                    if( written < 0 ) {
+                        if( errno == EINTR ) {
+                            continue;
+                        }
+                        fail( "write" );
+                    }
+                    ptr += written;
+                    left -= written;
+                }
+            }
+        }
+
+        for( unsigned int source = 0; source < sources; ++source ) {
+            free( buffer[source] );
+        }
+    };
+
+
+
+    //
+    // read poll's output until every line is back or it goes quiet
+    //
+    void collect() {
+        const bool toggle = strcmp( scenario->kind, "toggle" ) == 0;
+        static char buffer[1 << 16];
+        size_t have = 0;
+
+        while( received < events ) {
+            struct pollfd wait = { out, POLLIN, 0 };
+            if( poll( &wait, 1, idleTimeout ) <= 0 ) {
+                break;
+            }
+
+            const ssize_t count = read( out, buffer + have, sizeof( buffer ) - have );
+            if( count <= 0 ) {
+                break;
+            }
+            const long_time_t time = now();
+            have += count;
+
+            char *start = buffer;
+            char *end;
+            while( (end = (char *)memchr( start, '\n', buffer + have - start )) ) {
+                // values come back in order, lines carry their number
+                const unsigned long event = toggle ? received : strtoul( start, NULL, 10 );
+                if( event < events && received < events ) {
+                    latency[received++] = time - sent[event];
+                }
+                start = end + 1;
+            }
+
+            have = buffer + have - start;
+            memmove( buffer, start, have );
+        }
+    };
+
+
+
+    //
+    // ask poll for its statistics and count its system calls: a wait per
+    // wakeup, the reads and a write per latency sample
+    //
+    unsigned long syscalls() {
+        kill( pid, SIGUSR1 );
+
+        static char buffer[1 << 16];
+        size_t have = 0;
+        while( have < sizeof( buffer ) - 1 ) {
+            struct pollfd wait = { err, POLLIN, 0 };
+            if( poll( &wait, 1, idleTimeout ) <= 0 ) {
+                break;
+            }
+            const ssize_t count = read( err, buffer + have, sizeof( buffer ) - 1 - have );
+            if( count <= 0 ) {
+                break;
+            }
+            have += count;
+            buffer[have] = '\0';
+            if( strstr( buffer, "wakeup " ) && strstr( strstr( buffer, "wakeup " ), "\n\n" ) ) {
+                break;
+            }
+        }
+        buffer[have] = '\0';
+
+        unsigned long total = 0;
+        for( const char *ptr = buffer; (ptr = strstr( ptr, " reads=" )); ++ptr ) {
+            total += strtoul( ptr + 7, NULL, 10 );
+        }
+        const char *latency = strstr( buffer, "latency count=" );
+        const char *wakeup = strstr( buffer, "wakeup count=" );
+        total += latency ? strtoul( latency + 14, NULL, 10 ) : 0;
+        total += wakeup ? strtoul( wakeup + 13, NULL, 10 ) : 0;
+        return total;
+    };
+
+
+
+    //
+    // latency percentile in microseconds
+    //
+    double percentile( const unsigned int perMille ) {
+        if( !received ) {
+            return 0;
+        }
+        const unsigned int index = std::min( (unsigned long)received - 1, (unsigned long)received * perMille / 1000 );
+        return (double)latency[index] / MICROSECOND;
+    };
+
+
+
+public:
+    Bench( const Scenario *runScenario, const unsigned int runEvents ) {
+        scenario = runScenario;
+        events = runEvents;
+        received = 0;
+
+        sent = (long_time_t *)calloc( events, sizeof( long_time_t ) );
+        latency = (long_time_t *)calloc( events, sizeof( long_time_t ) );
+        if( !sent || !latency ) {
+            fail( "malloc" );
+        }
+
+        snprintf( directory, sizeof( directory ), "/tmp/pollbench.XXXXXX" );
+        if( !mkdtemp( directory ) ) {
+            fail( "mkdtemp" );
+        }
+    };
+
+
+
+    //
+    // run the scenario and print its line of results
+    //
+    void run( const char *poll ) {
+        sources();
+        start( poll );
+
+        const long_time_t begin = now();
+        pthread_t thread;
+        if( pthread_create( &thread, NULL, generate, this ) ) {
+            fail( "pthread_create" );
+        }
+        collect();
+        const long_time_t elapsed = now() - begin;
+        pthread_join( thread, NULL );
+
+        const unsigned long calls = syscalls();
+        kill( pid, SIGTERM );
+
+        int status;
+        struct rusage usage;
+        wait4( pid, &status, 0, &usage );
+
+        std::sort( latency, latency + received );
+        const double cpu = usage.ru_utime.tv_sec * 1e6 + usage.ru_utime.tv_usec + usage.ru_stime.tv_sec * 1e6 + usage.ru_stime.tv_usec;
+        const double per = received ? received : 1;
+
+        printf( "%-20s %7u %10.0f %8.1f %8.1f %8.1f %9.2f %7.2f %7.2f%s\n",
+                scenario->name, received, received * (double)SECOND / elapsed,
+                percentile( 500 ), percentile( 990 ), percentile( 999 ),
+                cpu / per, calls / per, (usage.ru_nvcsw + usage.ru_nivcsw) / per,
+                received < events ? "  (lines missing)" : "" );
+        fflush( stdout );
+    };
+
+
+
+    ~Bench() {
+        for( unsigned int source = 0; source < scenario->sources; ++source ) {
+            close( fd[source] );
+            if( slave[source] >= 0 ) {
+                close( slave[source] );
+
+            } else {
+                unlink( path[source] );
+            }
+        }
+        close( out );
+        close( err );
+        rmdir( directory );
+        free( sent );
+        free( latency );
+    };
+};
+
+
+
+//
+// main
+//
+int main( const int argc, char **argv ) {
+    unsigned int events = eventsDefault;
+    const char *only = NULL;
+    const char *poll = NULL;
+
+    for( int arg = 1; arg < argc; ++arg ) {
+        if( strcmp( argv[arg], "--events" ) == 0 && arg + 1 < argc ) {
+            events = strtoul( argv[++arg], NULL, 0 );
+
+        } else if( strcmp( argv[arg], "--only" ) == 0 && arg + 1 < argc ) {
+            only = argv[++arg];
+
+        } else if( *argv[arg] != '-' && !poll ) {
+            poll = argv[arg];
+
+        } else {
+            poll = NULL;
+            break;
+        }
+    }
+
+    if( !poll || !events ) {
+        fprintf( stderr, "Usage: %s [--events N] [--only NAME] POLL\n", argv[0] );
+        exit( 2 );
+    }
+
+    signal( SIGPIPE, SIG_IGN );
+
+    printf( "%-20s %7s %10s %8s %8s %8s %9s %7s %7s\n",
+            "scenario", "events", "events/s", "p50us", "p99us", "p999us", "cpu-us/ev", "sys/ev", "csw/ev" );
+
+    for( unsigned int index = 0; index < sizeof( scenarios ) / sizeof( scenarios[0] ); ++index ) {
+        if( only && strcmp( only, scenarios[index].name ) != 0 ) {
+            continue;
+        }
+
+        // the paced scenarios are kept short
+        const unsigned int count = scenarios[index].rate ? std::min( events, scenarios[index].rate * 2 ) : events;
+        Bench bench( &scenarios[index], count );
+        bench.run( poll );
+    }
+    return 0;
+};
@@ -0,0 +1,76 @@
+//
+// Copyright 2013,2014,2015 Tarim
+//
+// Poll is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// Poll is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with Poll.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Pollcat copies the output of poll --shm NAME from the shared memory
+// ring to stdout.  Any number of pollcats can follow the same ring.
+//
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ring.h"
+
+
+
+// Largest record the ring can hold
+char buffer[ringCapacity / 4];
+
+
+
+//
+// main
+//
+int main( const int argc, char **argv ) {
+    if( argc != 2 ) {
+        fprintf( stderr, "Usage: %s NAME\n", argv[0] );
+        exit( 2 );
+    }
+
+    RingReader reader;
+    if( !reader.open( argv[1] ) ) {
+        perror( argv[1] );
+        exit( 1 );
+    }
+
+    uint64_t lost = 0;
+    while( true ) {
+        const ssize_t length = reader.read( buffer, sizeof( buffer ), -1 );
+        if( length < 0 ) {
+            perror( "read" );
+            exit( 1 );
+        }
+
+        if( reader.lost != lost ) {
+            fprintf( stderr, "Lost: %llu bytes\n", (unsigned long long)(reader.lost - lost) );
+            lost = reader.lost;
+        }
+
+        for( ssize_t written = 0; written < length; ) {
+            const ssize_t count = write( STDOUT_FILENO, buffer + written, length - written );
+            if( count < 0 ) {
+                if( errno == EINTR ) {
+                    continue;
+                }
+                perror( "write" );
+                exit( 1 );
+            }
+            written += count;
+        }
+    }
+};
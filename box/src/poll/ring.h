@@ -0,0 +1,396 @@
+//
+// Copyright 2013,2014,2015 Tarim
+//
+// Poll is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Poll is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with Poll.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// Ring is a shared memory transport for poll's output.  A single writer
+// (poll --shm NAME) publishes records into a ring in POSIX shared memory
+// and any number of readers (pollcat NAME) follow it, each with its own
+// cursor.  The writer never waits for readers; a reader which falls more
+// than half the ring's capacity behind loses records and is told how many
+// bytes it missed.
+//
+// Readers sleep on a futex in the shared header and the writer only makes
+// a system call to wake them when one is waiting.  The futex needs the
+// header writable so the ring is created mode 0660: readers run as the
+// writer's user or in its group.
+//
+// Layout:
+//   RingHeader         (ringDataOffset bytes)
+//   data[capacity]     records, each 8 byte aligned:
+//                        uint32 length   payload length
+//                        uint32 flags    ringPad: skip to the start of data
+//                        payload
+//
+
+#ifndef POLL_RING_H
+#define POLL_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+
+
+const uint32_t ringMagic = 0x676e6952;         // "Ring"
+const uint32_t ringVersion = 1;
+const size_t ringDataOffset = 64;               // header is one cache line
+const uint32_t ringCapacity = 1 << 20;          // default data size
+const uint32_t ringRecordHeader = 8;
+const uint32_t ringPad = 1;
+const mode_t ringMode = 0660;                   // readers map it read/write too
+
+
+
+//
+// RingHeader
+//
+// Shared between the writer and readers.  head and sequence are only
+// accessed atomically.
+//
+struct RingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;          // bytes of data, a power of two
+    uint32_t reserved;
+    uint64_t head;              // total bytes published
+    uint32_t sequence;          // futex word, bumped for every record
+    uint32_t waiters;           // readers sleeping on sequence
+};
+
+
+
+//
+// Ring class
+//
+// Common mapping code for the writer and reader
+//
+class Ring {
+protected:
+    RingHeader *header;
+    char *data;
+    uint32_t mask;
+
+    //
+    // round up to the record alignment
+    //
+    static uint32_t align( const uint32_t length ) {
+        return (length + 7) & ~7u;
+    };
+
+
+
+    //
+    // map a shared memory object, returns false with errno set on failure
+    //
+    bool map( const int fd, const size_t size, const int prot ) {
+        void *addr = mmap( NULL, size, prot, MAP_SHARED, fd, 0 );
+        close( fd );
+        if( addr == MAP_FAILED ) {
+            return false;
+        }
+
+        header = (RingHeader *)addr;
+        data = (char *)addr + ringDataOffset;
+        return true;
+    };
+
+
+
+    //
+    // futex system call on the shared sequence
+    //
+    long futex( const int op, const uint32_t val, const struct timespec *timeout ) {
+        return syscall( SYS_futex, &header->sequence, op, val, timeout, NULL, 0 );
+    };
+
+
+
+public:
+    Ring() {
+        header = NULL;
+        data = NULL;
+        mask = 0;
+    };
+
+
+
+    //
+    // largest record which can be published
+    //
+    size_t maxRecord() {
+        return header->capacity / 4 - ringRecordHeader;
+    };
+};
+
+
+
+//
+// RingWriter class
+//
+// Used by poll to publish its output
+//
+class RingWriter : public Ring {
+public:
+    //
+    // create (or take over) the named ring, returns false with errno set on failure
+    //
+    bool create( const char *name, const uint32_t capacity = ringCapacity ) {
+        const int fd = shm_open( name, O_CREAT | O_RDWR, ringMode );
+        if( fd < 0 ) {
+            return false;
+        }
+
+        // not left to the umask, which would take away the group's write
+        if( fchmod( fd, ringMode ) < 0 ) {
+            close( fd );
+            return false;
+        }
+
+        const size_t size = ringDataOffset + capacity;
+        if( ftruncate( fd, size ) < 0 || !map( fd, size, PROT_READ | PROT_WRITE ) ) {
+            return false;
+        }
+
+        header->magic = ringMagic;
+        header->version = ringVersion;
+        header->capacity = capacity;
+        mask = capacity - 1;
+        __atomic_store_n( &header->head, 0, __ATOMIC_RELEASE );
+        return true;
+    };
+
+
+
+    //
+    // copy a set of iovecs into the ring as one record and wake any readers
+    // returns false if the record is too big
+    //
+    bool publish( const struct iovec *vec, const int count ) {
+        size_t length = 0;
+        for( int index = 0; index < count; ++index ) {
+            length += vec[index].iov_len;
+        }
+        if( length > maxRecord() ) {
+            return false;
+        }
+
+        uint64_t head = header->head;
+        const uint32_t span = ringRecordHeader + align( length );
+
+        // as a seqlock writer: the last publish's head is seen before any
+        // of this record's bytes, so a reader copying them knows to check
+        __atomic_thread_fence( __ATOMIC_RELEASE );
+
+        // records don't wrap, pad to the start of the ring if it won't fit
+        uint32_t offset = head & mask;
+        if( offset + span > header->capacity ) {
+            uint32_t *pad = (uint32_t *)(data + offset);
+            pad[0] = header->capacity - offset - ringRecordHeader;
+            pad[1] = ringPad;
+            head += header->capacity - offset;
+            offset = 0;
+        }
+
+        uint32_t *record = (uint32_t *)(data + offset);
+        record[0] = length;
+        record[1] = 0;
+
+        char *ptr = data + offset + ringRecordHeader;
+        for( int index = 0; index < count; ++index ) {
+            memcpy( ptr, vec[index].iov_base, vec[index].iov_len );
+            ptr += vec[index].iov_len;
+        }
+
+        __atomic_store_n( &header->head, head + span, __ATOMIC_RELEASE );
+        __atomic_add_fetch( &header->sequence, 1, __ATOMIC_SEQ_CST );
+        if( __atomic_load_n( &header->waiters, __ATOMIC_SEQ_CST ) ) {
+            futex( FUTEX_WAKE, INT_MAX, NULL );
+        }
+        return true;
+    };
+};
+
+
+
+//
+// RingReader class
+//
+// Follows a ring from the time it is opened
+//
+// RingReader reader;
+// if( !reader.open( "box" ) ) ...
+// while( (length = reader.read( buffer, sizeof( buffer ), -1 )) >= 0 ) ...
+//
+class RingReader : public Ring {
+private:
+    uint64_t cursor;            // total bytes read
+
+    //
+    // the writer could be writing up to a pad and a record beyond head,
+    // each less than a quarter of the ring, so the record at cursor is
+    // only safe if that is still a lap behind
+    //
+    bool overwritten( const uint64_t head ) {
+        return head - cursor + header->capacity / 2 > header->capacity;
+    };
+
+
+
+    //
+    // a length read from the ring which can't be right, as it was being
+    // overwritten, and mustn't be used to copy
+    //
+    bool garbled( const uint32_t length, const uint32_t flags ) {
+        const uint32_t room = header->capacity - (cursor & mask) - ringRecordHeader;
+        return length > room || (!(flags & ringPad) && length > maxRecord());
+    };
+
+public:
+    uint64_t lost;              // bytes missed because the reader fell behind
+
+    //
+    // open the named ring, returns false with errno set on failure
+    //
+    bool open( const char *name ) {
+        // the futex needs write access to the header so the ring is mapped
+        // read/write but only the header's waiters count is ever written
+        const int fd = shm_open( name, O_RDWR, 0 );
+        if( fd < 0 ) {
+            return false;
+        }
+
+        struct stat status;
+        if( fstat( fd, &status ) < 0 || (size_t)status.st_size < ringDataOffset ) {
+            close( fd );
+            errno = EINVAL;
+            return false;
+        }
+
+        if( !map( fd, status.st_size, PROT_READ | PROT_WRITE ) ) {
+            return false;
+        }
+
+        // mask and the copies rely on the capacity being a power of two
+        if( header->magic != ringMagic || header->version != ringVersion ||
+            header->capacity == 0 || (header->capacity & (header->capacity - 1)) ||
+            ringDataOffset + header->capacity > (size_t)status.st_size ) {
+            errno = EINVAL;
+            return false;
+        }
+
+        mask = header->capacity - 1;
+        cursor = __atomic_load_n( &header->head, __ATOMIC_ACQUIRE );
+        lost = 0;
+        return true;
+    };
+
+
+
+    //
+    // read the next record into buffer
+    // wait up to timeout milliseconds (-1 forever) for one to arrive
+    // returns the record length, 0 on timeout or -1 with errno set
+    // records longer than size are truncated
+    //
+    ssize_t read( char *buffer, const size_t size, const int timeout ) {
+        while( true ) {
+            const uint32_t sequence = __atomic_load_n( &header->sequence, __ATOMIC_SEQ_CST );
+            uint64_t head = __atomic_load_n( &header->head, __ATOMIC_ACQUIRE );
+
+            // writer restarted
+            if( head < cursor ) {
+                cursor = head;
+            }
+
+            // fell too far behind - skip to the latest record
+            if( overwritten( head ) ) {
+                lost += head - cursor;
+                cursor = head;
+            }
+
+            if( head != cursor ) {
+                const uint32_t *record = (const uint32_t *)(data + (cursor & mask));
+                const uint32_t length = record[0];
+                const uint32_t flags = record[1];
+
+                if( garbled( length, flags ) ) {
+                    head = __atomic_load_n( &header->head, __ATOMIC_ACQUIRE );
+                    lost += head - cursor;
+                    cursor = head;
+                    continue;
+                }
+
+                if( flags & ringPad ) {
+                    cursor += ringRecordHeader + length;
+                    continue;
+                }
+
+                const size_t copy = length < size ? length : size;
+                memcpy( buffer, (const char *)record + ringRecordHeader, copy );
+
+                // check the writer hasn't overwritten the record while we
+                // copied it, the copy's loads mustn't move after the check
+                __atomic_thread_fence( __ATOMIC_ACQUIRE );
+                head = __atomic_load_n( &header->head, __ATOMIC_ACQUIRE );
+                if( overwritten( head ) ) {
+                    lost += head - cursor;
+                    cursor = head;
+                    continue;
+                }
+
+                cursor += ringRecordHeader + align( length );
+                return copy;
+            }
+
+            // nothing to read so sleep until the sequence changes
+            if( timeout == 0 ) {
+                return 0;
+            }
+
+            struct timespec ts;
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000;
+
+            __atomic_add_fetch( &header->waiters, 1, __ATOMIC_SEQ_CST );
+            const long result = futex( FUTEX_WAIT, sequence, timeout < 0 ? NULL : &ts );
+            const int error = errno;
+            __atomic_sub_fetch( &header->waiters, 1, __ATOMIC_SEQ_CST );
+
+            if( result < 0 ) {
+                if( error == ETIMEDOUT ) {
+                    return 0;
+
+                } else if( error != EAGAIN && error != EINTR ) {
+                    errno = error;
+                    return -1;
+                }
+            }
+        }
+    };
+};
+
+#endif